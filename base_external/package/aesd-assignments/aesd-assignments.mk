@@ -13,9 +13,12 @@ AESD_ASSIGNMENTS_VERSION = '#COMMIT VERSION NUMBER'
 AESD_ASSIGNMENTS_SITE = '#GITHUB REPOSITORY LINK'
 AESD_ASSIGNMENTS_SITE_METHOD = git
 AESD_ASSIGNMENTS_GIT_SUBMODULES = YES
+# build profile of the Makefiles, release is -O2 with LTO
+AESD_ASSIGNMENTS_PROFILE = release
 
 define AESD_ASSIGNMENTS_BUILD_CMDS
-	$(MAKE) $(TARGET_CONFIGURE_OPTS) -C $(@D)/finder-app all
+	$(MAKE) $(TARGET_CONFIGURE_OPTS) PROFILE=$(AESD_ASSIGNMENTS_PROFILE) -C $(@D)/finder-app all
+	$(MAKE) $(TARGET_CONFIGURE_OPTS) PROFILE=$(AESD_ASSIGNMENTS_PROFILE) -C $(@D)/server all
 endef
 
 # TODO add your writer, finder and finder-test utilities/scripts to the installation steps below
@@ -23,6 +26,7 @@ define AESD_ASSIGNMENTS_INSTALL_TARGET_CMDS
 	$(INSTALL) -d 0755 $(@D)/conf/ $(TARGET_DIR)/etc/finder-app/conf/
 	$(INSTALL) -m 0755 $(@D)/conf/* $(TARGET_DIR)/etc/finder-app/conf/
 	$(INSTALL) -m 0755 $(@D)/assignment-autotest/test/assignment4/* $(TARGET_DIR)/bin
+	$(INSTALL) -m 0755 $(@D)/server/aesdsocket $(TARGET_DIR)/usr/bin
 endef
 
 $(eval $(generic-package))
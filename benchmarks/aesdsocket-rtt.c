@@ -0,0 +1,205 @@
+/*
+  aesdsocket-rtt: round trip time of one packet through aesdsocket
+
+  usage: aesdsocket-rtt [-n iterations] [-p port | -u path | -a name]
+
+  Connects over loopback TCP (default port 9000), a UNIX domain socket
+  path or an abstract UNIX socket name, sends a short packet and waits
+  for the whole data log to come back, n times. Prints min/median/p99
+  in microseconds.
+
+  Run the server with -t 0 so no timestamp line changes the reply size.
+ */
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+static int connect_tcp(int port)
+{
+  struct sockaddr_in addr;
+  int yes = 1;
+  int fd;
+
+  fd = socket(AF_INET, SOCK_STREAM, 0);
+  if (fd == -1)
+    {
+      perror("socket error");
+      exit(1);
+    }
+  setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &yes, sizeof yes);
+
+  memset(&addr, 0, sizeof addr);
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons(port);
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  if (connect(fd, (struct sockaddr *) &addr, sizeof addr) == -1)
+    {
+      perror("connect error");
+      exit(1);
+    }
+  return fd;
+}
+
+static int connect_unix(const char *name, int abstract)
+{
+  struct sockaddr_un addr;
+  size_t len = strlen(name);
+  int fd;
+
+  if (len + 1 > sizeof addr.sun_path)
+    {
+      fprintf(stderr, "unix socket name too long: %s\n", name);
+      exit(1);
+    }
+  memset(&addr, 0, sizeof addr);
+  addr.sun_family = AF_UNIX;
+  memcpy(addr.sun_path + (abstract ? 1 : 0), name, len);
+
+  fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (fd == -1)
+    {
+      perror("socket error");
+      exit(1);
+    }
+  if (connect(fd, (struct sockaddr *) &addr,
+	      offsetof(struct sockaddr_un, sun_path) + len + 1) == -1)
+    {
+      perror("connect error");
+      exit(1);
+    }
+  return fd;
+}
+
+static double now_us(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+// read until expected bytes arrived, return -1 on eof or error
+static int recv_len(int fd, char *buf, size_t buf_size, size_t expected)
+{
+  ssize_t n;
+
+  while (expected > 0)
+    {
+      n = recv(fd, buf, buf_size < expected ? buf_size : expected, 0);
+      if (n <= 0)
+	return -1;
+      expected -= n;
+    }
+  return 0;
+}
+
+static int cmp_double(const void *a, const void *b)
+{
+  double x = *(const double *) a, y = *(const double *) b;
+
+  return (x > y) - (x < y);
+}
+
+int main(int argc, char **argv)
+{
+  const char *unix_name = NULL;
+  int abstract = 0;
+  int port = 9000;
+  int iterations = 1000;
+  char buf[65536];
+  char marker[64];
+  size_t history = 0;
+  size_t mlen;
+  double *samples;
+  double t0;
+  ssize_t n;
+  int fd;
+  int c;
+  int i;
+
+  while ((c = getopt(argc, argv, "n:p:u:a:")) != -1)
+    {
+      switch (c)
+	{
+	case 'n':
+	  iterations = atoi(optarg);
+	  break;
+	case 'p':
+	  port = atoi(optarg);
+	  break;
+	case 'u':
+	  unix_name = optarg;
+	  abstract = 0;
+	  break;
+	case 'a':
+	  unix_name = optarg;
+	  abstract = 1;
+	  break;
+	default:
+	  fprintf(stderr, "usage: %s [-n iterations] [-p port | -u path | -a name]\n", argv[0]);
+	  return 1;
+	}
+    }
+  if (iterations < 1)
+    iterations = 1;
+
+  fd = unix_name ? connect_unix(unix_name, abstract) : connect_tcp(port);
+
+  // the reply is the whole log, learn its size from a unique first packet
+  mlen = snprintf(marker, sizeof marker, "rtt-%d-%ld\n", getpid(), (long) time(NULL));
+  if (send(fd, marker, mlen, 0) != (ssize_t) mlen)
+    {
+      perror("send error");
+      return 1;
+    }
+  for (;;)
+    {
+      n = recv(fd, buf, sizeof buf, 0);
+      if (n <= 0)
+	{
+	  fprintf(stderr, "connection closed before the first reply\n");
+	  return 1;
+	}
+      history += n;
+      if ((size_t) n >= mlen && memcmp(buf + n - mlen, marker, mlen) == 0)
+	break;
+    }
+
+  samples = malloc(iterations * sizeof *samples);
+  if (samples == NULL)
+    {
+      perror("malloc error");
+      return 1;
+    }
+
+  for (i = 0; i < iterations; i++)
+    {
+      history += 2;
+      t0 = now_us();
+      if (send(fd, "x\n", 2, 0) != 2 || recv_len(fd, buf, sizeof buf, history) == -1)
+	{
+	  fprintf(stderr, "transfer failed at iteration %d\n", i);
+	  return 1;
+	}
+      samples[i] = now_us() - t0;
+    }
+  close(fd);
+
+  qsort(samples, iterations, sizeof *samples, cmp_double);
+  printf("%-8s n=%d min=%.1fus median=%.1fus p99=%.1fus\n",
+	 unix_name ? (abstract ? "abstract" : "unix") : "tcp",
+	 iterations, samples[0], samples[iterations / 2],
+	 samples[(int) (iterations * 0.99)]);
+  free(samples);
+  return 0;
+}
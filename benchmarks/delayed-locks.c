@@ -0,0 +1,164 @@
+/*
+  delayed-locks: many concurrent delayed mutex acquisitions
+
+  usage: delayed-locks [-m pool | thread] [-n requests] [-k mutexes]
+                       [-d max_delay_ms] [-h hold_ms] [-w workers]
+
+  Queues n requests to wait a random 0..d ms, obtain one of k mutexes,
+  hold it h ms and release it, either on the delay executor of
+  examples/threading (pool, default) or with start_thread_obtaining_mutex,
+  a thread each (thread). Waits for all of them and prints how late the
+  last one finished past its due time, the peak resident and virtual
+  memory and how many requests failed.
+ */
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "threading.h"
+
+static double now_ms(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+}
+
+// a "Vm...:" line of /proc/self/status, in kB
+static long vm_kb(const char *name)
+{
+  char line[256];
+  long kb = -1;
+  FILE *f;
+
+  f = fopen("/proc/self/status", "r");
+  if (f == NULL)
+    return -1;
+  while (fgets(line, sizeof line, f))
+    if (strncmp(line, name, strlen(name)) == 0)
+      kb = atol(line + strlen(name) + 1);
+  fclose(f);
+  return kb;
+}
+
+int main(int argc, char **argv)
+{
+  struct delay_executor *ex = NULL;
+  struct thread_data **tasks;
+  struct thread_data *data;
+  pthread_mutex_t *mutexes;
+  pthread_t *threads;
+  const char *mode = "pool";
+  int requests = 100000;
+  int nmutexes = 0;
+  int max_delay = 1000;
+  int hold = 1;
+  int workers = 0;
+  int started = 0;
+  int failed = 0;
+  double due = 0;
+  double t0;
+  double end;
+  int delay;
+  int out;
+  int c;
+  int i;
+
+  while ((c = getopt(argc, argv, "m:n:k:d:h:w:")) != -1)
+    {
+      switch (c)
+	{
+	case 'm':
+	  mode = optarg;
+	  break;
+	case 'n':
+	  requests = atoi(optarg);
+	  break;
+	case 'k':
+	  nmutexes = atoi(optarg);
+	  break;
+	case 'd':
+	  max_delay = atoi(optarg);
+	  break;
+	case 'h':
+	  hold = atoi(optarg);
+	  break;
+	case 'w':
+	  workers = atoi(optarg);
+	  break;
+	default:
+	  fprintf(stderr, "usage: %s [-m pool | thread] [-n requests] [-k mutexes]"
+		  " [-d max_delay_ms] [-h hold_ms] [-w workers]\n", argv[0]);
+	  return 1;
+	}
+    }
+  if (requests < 1)
+    requests = 1;
+  if (nmutexes < 1 || nmutexes > requests)
+    nmutexes = requests;
+  if (max_delay < 0)
+    max_delay = 0;
+
+  tasks = calloc(requests, sizeof *tasks);
+  threads = calloc(requests, sizeof *threads);
+  mutexes = calloc(nmutexes, sizeof *mutexes);
+  if (tasks == NULL || threads == NULL || mutexes == NULL)
+    {
+      perror("calloc error");
+      return 1;
+    }
+  for (i = 0; i < nmutexes; i++)
+    pthread_mutex_init(&mutexes[i], NULL);
+  if (strcmp(mode, "pool") == 0)
+    {
+      ex = delay_executor_create(workers);
+      if (ex == NULL)
+	{
+	  fprintf(stderr, "could not create the executor\n");
+	  return 1;
+	}
+    }
+  // start_thread_obtaining_mutex reports every request on stdout
+  out = dup(STDOUT_FILENO);
+  if (out == -1 || (ex == NULL && freopen("/dev/null", "w", stdout) == NULL))
+    {
+      perror("stdout error");
+      return 1;
+    }
+
+  srand(1);
+  t0 = now_ms();
+  for (i = 0; i < requests; i++, started++)
+    {
+      delay = max_delay ? rand() % (max_delay + 1) : 0;
+      if (now_ms() - t0 + delay + hold > due)
+	due = now_ms() - t0 + delay + hold;
+      if (ex ? !schedule_obtaining_mutex(ex, &tasks[i], &mutexes[i % nmutexes], delay, hold)
+	  : !start_thread_obtaining_mutex(&threads[i], &mutexes[i % nmutexes], delay, hold))
+	break;
+    }
+
+  for (i = 0; i < started; i++)
+    {
+      if (ex)
+	data = delay_executor_join(ex, tasks[i]);
+      else if (pthread_join(threads[i], (void **) &data) != 0)
+	data = NULL;
+      if (data == NULL || !data->thread_complete_success)
+	failed++;
+      free(data);
+    }
+  end = now_ms() - t0;
+
+  dprintf(out, "%-6s requests=%d started=%d failed=%d mutexes=%d due=%.0fms"
+	  " done=%.0fms late=%.1fms rss_peak=%ldkB vm_peak=%ldkB\n",
+	  mode, requests, started, failed, nmutexes, due, end, end - due,
+	  vm_kb("VmHWM"), vm_kb("VmPeak"));
+  if (ex)
+    delay_executor_destroy(ex);
+  return started == requests && failed == 0 ? 0 : 1;
+}
@@ -0,0 +1,169 @@
+/*
+  exec-pool: many short commands on the exec pool of examples/systemcalls
+
+  usage: exec-pool [-n commands] [-j max_running] [-t timeout_ms]
+                   [-s every] [-f every]
+
+  Submits n commands (default 500) to a pool running at most j at once
+  (default 16), each with a timeout of t ms (default 200). They run
+  /bin/true, except every s-th (default 50) runs /bin/sleep 10 and has to
+  be killed by the timeout, and every f-th (default 100) names a missing
+  command and fails to start. Prints the commands per second and the
+  slowest command, and checks that every command was reported once,
+  outside exec_submit, with the expected outcome.
+ */
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include "execpool.h"
+
+enum outcome { EXIT_OK, TIMED_OUT, NOT_STARTED };
+
+struct job {
+  enum outcome expect;
+  int reported;
+};
+
+static bool submitting;
+static int reentered;
+static int wrong;
+static double slowest;
+
+static double now_ms(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+}
+
+static void done(const struct exec_result *r)
+{
+  struct job *job = r->arg;
+  bool ok;
+
+  if (submitting)
+    reentered++;
+  job->reported++;
+  switch (job->expect)
+    {
+    case EXIT_OK:
+      ok = r->pid != -1 && !r->timed_out && WIFEXITED(r->status) && WEXITSTATUS(r->status) == 0;
+      break;
+    case TIMED_OUT:
+      ok = r->pid != -1 && r->timed_out && WIFSIGNALED(r->status);
+      break;
+    default:
+      ok = r->pid == -1 && r->error != 0;
+      break;
+    }
+  if (!ok)
+    wrong++;
+  if (r->seconds > slowest)
+    slowest = r->seconds;
+}
+
+int main(int argc, char **argv)
+{
+  char *true_argv[] = { "/bin/true", NULL };
+  char *sleep_argv[] = { "/bin/sleep", "10", NULL };
+  char *missing_argv[] = { "/nonexistent/command", NULL };
+  char *const *cmd_argv;
+  struct exec_pool *pool;
+  struct job *jobs;
+  int commands = 500;
+  int max_running = 16;
+  int timeout = 200;
+  int sleep_every = 50;
+  int fail_every = 100;
+  int unreported = 0;
+  double t0;
+  int c;
+  int i;
+
+  while ((c = getopt(argc, argv, "n:j:t:s:f:")) != -1)
+    {
+      switch (c)
+	{
+	case 'n':
+	  commands = atoi(optarg);
+	  break;
+	case 'j':
+	  max_running = atoi(optarg);
+	  break;
+	case 't':
+	  timeout = atoi(optarg);
+	  break;
+	case 's':
+	  sleep_every = atoi(optarg);
+	  break;
+	case 'f':
+	  fail_every = atoi(optarg);
+	  break;
+	default:
+	  fprintf(stderr, "usage: %s [-n commands] [-j max_running] [-t timeout_ms]"
+		  " [-s every] [-f every]\n", argv[0]);
+	  return 1;
+	}
+    }
+  if (commands < 1)
+    commands = 1;
+
+  jobs = calloc(commands, sizeof *jobs);
+  pool = exec_pool_create(max_running);
+  if (jobs == NULL || pool == NULL)
+    {
+      perror("exec_pool_create error");
+      return 1;
+    }
+  exec_pool_set_grace(pool, 100);
+
+  t0 = now_ms();
+  for (i = 0; i < commands; i++)
+    {
+      cmd_argv = true_argv;
+      jobs[i].expect = EXIT_OK;
+      if (fail_every > 0 && i % fail_every == fail_every - 1)
+	{
+	  cmd_argv = missing_argv;
+	  jobs[i].expect = NOT_STARTED;
+	}
+      else if (sleep_every > 0 && i % sleep_every == sleep_every - 1)
+	{
+	  cmd_argv = sleep_argv;
+	  jobs[i].expect = TIMED_OUT;
+	}
+      submitting = true;
+      if (exec_submit(pool, cmd_argv, timeout, done, &jobs[i]) == -1)
+	{
+	  perror("exec_submit error");
+	  return 1;
+	}
+      submitting = false;
+      // keep the queue short, as a producer would
+      while (exec_pool_run(pool, 0) >= 2 * max_running)
+	exec_pool_run(pool, -1);
+    }
+  if (exec_pool_wait(pool) == -1)
+    {
+      perror("exec_pool_wait error");
+      return 1;
+    }
+  t0 = now_ms() - t0;
+  exec_pool_destroy(pool);
+
+  for (i = 0; i < commands; i++)
+    if (jobs[i].reported != 1)
+      unreported++;
+  printf("commands=%d max_running=%d timeout=%dms total=%.0fms rate=%.0f/s"
+	 " slowest=%.0fms wrong=%d unreported=%d reentered=%d\n",
+	 commands, max_running, timeout, t0, commands * 1e3 / t0,
+	 slowest * 1e3, wrong, unreported, reentered);
+  free(jobs);
+  return wrong || unreported || reentered ? 1 : 0;
+}
@@ -0,0 +1,204 @@
+/*
+  lock-sweep: throughput of the locks of examples/threading/lock.h
+
+  usage: lock-sweep [-d duration_ms] [-t threads,...] [-c critical_ns,...]
+                    [-k kind,...] [-n]
+
+  For every thread count (default 1,2,4,8) and critical section length
+  (default 0,100,1000 ns of busy work) every lock kind (default all) runs
+  its threads in a loop of acquire, critical section, release and as much
+  work again outside the lock, for duration ms (default 200). Prints the
+  acquisitions per second, the average wait and how many acquisitions had
+  to wait, and which kind did best for each combination. -n runs the
+  locks without statistics, which leaves out their clock reads but also
+  the wait columns.
+
+  The spinning kinds suffer badly once there are more threads than cpus:
+  the next owner may not be running.
+ */
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "lock.h"
+
+#define MAX_VALUES 16
+#define MAX_THREADS 256
+
+struct run {
+  struct lock lock;
+  long work;                    // loop iterations of one critical section
+  int stop;
+  uint64_t counter;             // updated under the lock
+};
+
+static double now_ns(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static void busy(long iterations)
+{
+  volatile long sink = 0;
+  long i;
+
+  for (i = 0; i < iterations; i++)
+    sink += i;
+}
+
+// busy() iterations per ns
+static double calibrate(void)
+{
+  long n = 10000000;
+  double t0 = now_ns();
+
+  busy(n);
+  return n / (now_ns() - t0);
+}
+
+static void *worker(void *arg)
+{
+  struct run *r = arg;
+
+  while (!__atomic_load_n(&r->stop, __ATOMIC_RELAXED))
+    {
+      lock_acquire(&r->lock);
+      busy(r->work);
+      r->counter++;
+      lock_release(&r->lock);
+      busy(r->work);
+    }
+  return NULL;
+}
+
+static int parse_list(char *arg, int *values)
+{
+  char *tok;
+  int n = 0;
+
+  for (tok = strtok(arg, ","); tok && n < MAX_VALUES; tok = strtok(NULL, ","))
+    values[n++] = atoi(tok);
+  return n;
+}
+
+int main(int argc, char **argv)
+{
+  pthread_t threads[MAX_THREADS];
+  int nthreads_list[MAX_VALUES] = { 1, 2, 4, 8 };
+  int cs_list[MAX_VALUES] = { 0, 100, 1000 };
+  int kinds[LOCK_KINDS] = { LOCK_PTHREAD, LOCK_TICKET, LOCK_MCS, LOCK_FUTEX };
+  int nthreads_count = 4;
+  int cs_count = 3;
+  int kind_count = LOCK_KINDS;
+  int duration = 200;
+  bool stats = true;
+  const struct lock_stats *s;
+  struct timespec ts;
+  struct run r;
+  double per_ns;
+  double rate;
+  double best_rate;
+  int best;
+  char *tok;
+  int c;
+  int i;
+  int j;
+  int k;
+  int t;
+
+  while ((c = getopt(argc, argv, "d:t:c:k:n")) != -1)
+    {
+      switch (c)
+	{
+	case 'd':
+	  duration = atoi(optarg);
+	  break;
+	case 't':
+	  nthreads_count = parse_list(optarg, nthreads_list);
+	  break;
+	case 'c':
+	  cs_count = parse_list(optarg, cs_list);
+	  break;
+	case 'k':
+	  kind_count = 0;
+	  for (tok = strtok(optarg, ","); tok && kind_count < LOCK_KINDS; tok = strtok(NULL, ","))
+	    {
+	      kinds[kind_count] = lock_kind_parse(tok);
+	      if (kinds[kind_count++] == -1)
+		{
+		  fprintf(stderr, "unknown lock kind %s\n", tok);
+		  return 1;
+		}
+	    }
+	  break;
+	case 'n':
+	  stats = false;
+	  break;
+	default:
+	  fprintf(stderr, "usage: %s [-d duration_ms] [-t threads,...] [-c critical_ns,...]"
+		  " [-k kind,...] [-n]\n", argv[0]);
+	  return 1;
+	}
+    }
+
+  per_ns = calibrate();
+  printf("%-8s %7s %7s %12s %12s %9s\n",
+	 "lock", "threads", "cs_ns", "acq/s", "avg_wait_ns", "contended");
+  for (i = 0; i < nthreads_count; i++)
+    {
+      if (nthreads_list[i] < 1 || nthreads_list[i] > MAX_THREADS)
+	continue;
+      for (j = 0; j < cs_count; j++)
+	{
+	  best = -1;
+	  best_rate = 0;
+	  for (k = 0; k < kind_count; k++)
+	    {
+	      memset(&r, 0, sizeof r);
+	      if (lock_init(&r.lock, kinds[k], stats) == -1)
+		{
+		  perror("lock_init error");
+		  return 1;
+		}
+	      r.work = cs_list[j] * per_ns;
+	      for (t = 0; t < nthreads_list[i]; t++)
+		if (pthread_create(&threads[t], NULL, worker, &r) != 0)
+		  {
+		    fprintf(stderr, "could not start thread %d\n", t);
+		    return 1;
+		  }
+	      ts.tv_sec = duration / 1000;
+	      ts.tv_nsec = (duration % 1000) * 1000000L;
+	      nanosleep(&ts, NULL);
+	      __atomic_store_n(&r.stop, 1, __ATOMIC_RELAXED);
+	      for (t = 0; t < nthreads_list[i]; t++)
+		pthread_join(threads[t], NULL);
+
+	      rate = r.counter * 1000.0 / duration;
+	      printf("%-8s %7d %7d %12.0f", lock_kind_name(kinds[k]),
+		     nthreads_list[i], cs_list[j], rate);
+	      s = r.lock.stats;
+	      if (s && s->acquisitions)
+		printf(" %12.0f %8.1f%%\n", (double) s->wait_ns / s->acquisitions,
+		       100.0 * s->contended / s->acquisitions);
+	      else
+		printf(" %12s %9s\n", "-", "-");
+	      if (rate > best_rate)
+		{
+		  best_rate = rate;
+		  best = kinds[k];
+		}
+	      lock_destroy(&r.lock);
+	    }
+	  printf("best     %7d %7d %s\n", nthreads_list[i], cs_list[j], lock_kind_name(best));
+	}
+    }
+  return 0;
+}
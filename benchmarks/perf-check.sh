@@ -0,0 +1,110 @@
+#!/bin/sh
+# Run the performance regression benchmarks and compare them with a baseline
+# usage: perf-check.sh bindir [baseline.json]
+#
+# bindir holds perf-micro, aesdsocket-rtt and aesdsocket, as built by the
+# benchmark target of CMake. The results go to bindir/perf-results.json.
+# Every metric is the median of several runs. One more than
+# PERF_TOLERANCE percent (default 30) worse than the baseline fails the
+# check. PERF_UPDATE=1 writes the results as the new baseline instead.
+
+set -e
+
+BINDIR=${1:?usage: perf-check.sh bindir [baseline.json]}
+BASELINE=${2:-$(dirname $0)/perf-baseline.json}
+TOLERANCE=${PERF_TOLERANCE:-30}
+RESULTS=${BINDIR}/perf-results.json
+
+# the server gets a log and a socket of its own, out of the way of one
+# which may be running, and no TCP listener
+WORKDIR=$(mktemp -d ${TMPDIR:-/tmp}/perf-check.XXXXXX)
+SOCKPATH=${WORKDIR}/aesdsocket.sock
+SERVER_PID=
+trap "[ -n \"\${SERVER_PID}\" ] && kill \${SERVER_PID} 2> /dev/null; rm -rf ${WORKDIR}; true" EXIT
+
+# end to end: round trips through the server, the median of the medians
+# of five runs; the tail latency is too noisy on a shared machine to gate on
+${BINDIR}/aesdsocket -t 0 -p 0 -f ${WORKDIR}/aesdsocketdata -u ${SOCKPATH} > /dev/null 2>&1 &
+SERVER_PID=$!
+# ready once a round trip goes through, the socket file shows up at bind
+# time, before the server listens
+tries=0
+until ${BINDIR}/aesdsocket-rtt -n 1 -u ${SOCKPATH} > /dev/null 2>&1; do
+    tries=$((tries + 1))
+    if [ ${tries} -gt 100 ] || ! kill -0 ${SERVER_PID} 2> /dev/null; then
+        echo "aesdsocket did not start" >&2
+        exit 1
+    fi
+    sleep 0.1
+done
+RTT=$(for run in 1 2 3 4 5; do ${BINDIR}/aesdsocket-rtt -n 2000 -u ${SOCKPATH}; done)
+
+{
+    ${BINDIR}/perf-micro | sed '1d;$d' | sed 's/,$//' | sed 's/$/,/'
+    echo "${RTT}" | awk '{
+        for (i = 1; i <= NF; i++) {
+            split($i, kv, "=")
+            if (kv[1] == "median")
+                v[n++] = kv[2] + 0
+        }
+    }
+    END {
+        # insertion sort, n is small
+        for (i = 1; i < n; i++)
+            for (j = i; j > 0 && v[j - 1] > v[j]; j--) {
+                t = v[j]; v[j] = v[j - 1]; v[j - 1] = t
+            }
+        m = n % 2 ? v[int(n / 2)] : (v[n / 2 - 1] + v[n / 2]) / 2
+        printf "  {\"name\": \"aesdsocket_rtt_median\", \"value\": %.3f, \"unit\": \"us\", \"better\": \"lower\"}\n", m
+    }'
+} | { echo "["; cat; echo "]"; } > ${RESULTS}
+
+if [ "${PERF_UPDATE}" = "1" ]; then
+    cp ${RESULTS} ${BASELINE}
+    echo "baseline ${BASELINE} updated"
+    cat ${BASELINE}
+    exit 0
+fi
+
+# one metric per line: name, value and direction
+awk -v tolerance=${TOLERANCE} '
+function field(line, key,    m) {
+    if (match(line, "\"" key "\": *\"[^\"]*\"")) {
+        m = substr(line, RSTART, RLENGTH)
+        sub(/^[^:]*: *"/, "", m)
+        sub(/"$/, "", m)
+        return m
+    }
+    if (match(line, "\"" key "\": *[-0-9.e+]+")) {
+        m = substr(line, RSTART, RLENGTH)
+        sub(/^[^:]*: */, "", m)
+        return m + 0
+    }
+    return ""
+}
+/"name"/ {
+    name = field($0, "name")
+    if (FNR == NR) {
+        base[name] = field($0, "value")
+        next
+    }
+    value = field($0, "value")
+    better = field($0, "better")
+    unit = field($0, "unit")
+    if (!(name in base) || base[name] == 0) {
+        printf "%-30s %12.1f %-5s (no baseline)\n", name, value, unit
+        next
+    }
+    change = (value - base[name]) * 100 / base[name]
+    worse = better == "higher" ? -change : change
+    status = worse > tolerance ? "REGRESSION" : "ok"
+    if (status != "ok")
+        failed++
+    printf "%-30s %12.1f %-5s baseline %12.1f %+7.1f%% %s\n", name, value, unit, base[name], change, status
+}
+END {
+    if (failed) {
+        printf "%d metric(s) regressed by more than %s%%\n", failed, tolerance
+        exit 1
+    }
+}' ${BASELINE} ${RESULTS}
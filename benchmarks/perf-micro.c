@@ -0,0 +1,234 @@
+/*
+  perf-micro: microbenchmarks of the hot paths, as JSON for perf-check.sh
+
+  usage: perf-micro [-r repeats]
+
+  Times scanfor() and send_all() of server/replay.c, do_exec() of
+  examples/systemcalls and start_thread_obtaining_mutex() of
+  examples/threading. Every measurement is taken repeats times (default 7)
+  and the median is kept: unlike the best, it does not hang on one lucky
+  run, so it moves less from one invocation to the next. Prints one
+  metric per line:
+
+    {"name": ..., "value": ..., "unit": ..., "better": "higher" | "lower"},
+ */
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <syslog.h>
+#include <sys/socket.h>
+#include "replay.h"
+#include "systemcalls.h"
+#include "threading.h"
+
+#define SCAN_SIZE (1 << 20)
+#define SCAN_ROUNDS 64
+#define REPLAY_SIZE (16 << 20)
+#define REPLAY_ROUNDS 8
+#define EXEC_ROUNDS 100
+#define THREAD_ROUNDS 1000
+
+static int metrics;
+
+static double perf_now(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void metric(const char *name, double value, const char *unit, const char *better)
+{
+  printf("%s  {\"name\": \"%s\", \"value\": %.3f, \"unit\": \"%s\", \"better\": \"%s\"}",
+	 metrics++ ? ",\n" : "", name, value, unit, better);
+}
+
+// scanfor over a buffer with the newline at its end, MB/s
+static double bench_scanfor(void)
+{
+  char *buf;
+  size_t pos;
+  double t0;
+  int i;
+
+  buf = malloc(SCAN_SIZE);
+  if (buf == NULL)
+    return 0;
+  memset(buf, 'x', SCAN_SIZE);
+  buf[SCAN_SIZE - 1] = '\n';
+  t0 = perf_now();
+  for (i = 0; i < SCAN_ROUNDS; i++)
+    scanfor(buf, '\n', SCAN_SIZE, &pos);
+  t0 = perf_now() - t0;
+  free(buf);
+  return (double) SCAN_SIZE * SCAN_ROUNDS / t0 / 1e6;
+}
+
+static void *drain(void *arg)
+{
+  char buf[65536];
+  int fd = *(int *) arg;
+
+  while (read(fd, buf, sizeof buf) > 0)
+    ;
+  return NULL;
+}
+
+// send_all of a log over a UNIX socket to a thread reading it, MB/s
+static double bench_send_all(void)
+{
+  char path[] = "/tmp/perf-micro-XXXXXX";
+  struct replay rp;
+  pthread_t reader;
+  char *buf;
+  double t0;
+  int sv[2];
+  int logfd;
+  int i;
+
+  buf = malloc(REPLAY_CHUNK);
+  logfd = mkstemp(path);
+  if (buf == NULL || logfd == -1 || socketpair(AF_UNIX, SOCK_STREAM, 0, sv) == -1)
+    return 0;
+  unlink(path);
+  memset(buf, 'x', REPLAY_CHUNK);
+  for (i = 0; i < REPLAY_SIZE / REPLAY_CHUNK; i++)
+    if (write(logfd, buf, REPLAY_CHUNK) != REPLAY_CHUNK)
+      return 0;
+  if (pthread_create(&reader, NULL, drain, &sv[1]) != 0)
+    return 0;
+
+  memset(&rp, 0, sizeof rp);
+  rp.zerocopy_threshold = 4 << 20;
+  rp.lockfd = -1;
+  t0 = perf_now();
+  for (i = 0; i < REPLAY_ROUNDS; i++)
+    send_all(sv[0], logfd, buf, REPLAY_CHUNK, &rp);
+  t0 = perf_now() - t0;
+
+  close(sv[0]);
+  pthread_join(reader, NULL);
+  close(sv[1]);
+  close(logfd);
+  free(buf);
+  return (double) REPLAY_SIZE * REPLAY_ROUNDS / t0 / 1e6;
+}
+
+// do_exec of /bin/true, microseconds per command
+static double bench_do_exec(void)
+{
+  double t0;
+  int saved;
+  int devnull;
+  int i;
+
+  // do_exec reports every command on stdout
+  fflush(stdout);
+  saved = dup(STDOUT_FILENO);
+  devnull = open("/dev/null", O_WRONLY);
+  dup2(devnull, STDOUT_FILENO);
+  t0 = perf_now();
+  for (i = 0; i < EXEC_ROUNDS; i++)
+    do_exec(1, "/bin/true");
+  t0 = perf_now() - t0;
+  fflush(stdout);
+  dup2(saved, STDOUT_FILENO);
+  close(saved);
+  close(devnull);
+  return t0 / EXEC_ROUNDS * 1e6;
+}
+
+// start_thread_obtaining_mutex without waits and its join, microseconds
+static double bench_thread_mutex(void)
+{
+  pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+  pthread_t thread;
+  void *data;
+  double t0;
+  int saved;
+  int devnull;
+  int i;
+
+  fflush(stdout);
+  saved = dup(STDOUT_FILENO);
+  devnull = open("/dev/null", O_WRONLY);
+  dup2(devnull, STDOUT_FILENO);
+  t0 = perf_now();
+  for (i = 0; i < THREAD_ROUNDS; i++)
+    {
+      if (start_thread_obtaining_mutex(&thread, &mutex, 0, 0))
+	{
+	  pthread_join(thread, &data);
+	  free(data);
+	}
+    }
+  t0 = perf_now() - t0;
+  fflush(stdout);
+  dup2(saved, STDOUT_FILENO);
+  close(saved);
+  close(devnull);
+  return t0 / THREAD_ROUNDS * 1e6;
+}
+
+static int cmp_double(const void *a, const void *b)
+{
+  double x = *(const double *) a;
+  double y = *(const double *) b;
+
+  return (x > y) - (x < y);
+}
+
+static double median(double (*bench)(void), int repeats)
+{
+  double *v;
+  double m;
+  int i;
+
+  v = malloc(repeats * sizeof *v);
+  if (v == NULL)
+    return 0;
+  for (i = 0; i < repeats; i++)
+    v[i] = bench();
+  qsort(v, repeats, sizeof *v, cmp_double);
+  m = repeats % 2 ? v[repeats / 2] : (v[repeats / 2 - 1] + v[repeats / 2]) / 2;
+  free(v);
+  return m;
+}
+
+int main(int argc, char **argv)
+{
+  int repeats = 7;
+  int c;
+
+  while ((c = getopt(argc, argv, "r:")) != -1)
+    {
+      switch (c)
+	{
+	case 'r':
+	  repeats = atoi(optarg);
+	  break;
+	default:
+	  fprintf(stderr, "usage: %s [-r repeats]\n", argv[0]);
+	  return 1;
+	}
+    }
+  if (repeats < 1)
+    repeats = 1;
+
+  // scanfor logs every call at LOG_DEBUG, keep that out of the way
+  setlogmask(LOG_UPTO(LOG_INFO));
+
+  printf("[\n");
+  metric("scanfor", median(bench_scanfor, repeats), "MB/s", "higher");
+  metric("send_all", median(bench_send_all, repeats), "MB/s", "higher");
+  metric("do_exec", median(bench_do_exec, repeats), "us", "lower");
+  metric("start_thread_obtaining_mutex", median(bench_thread_mutex, repeats), "us", "lower");
+  printf("\n]\n");
+  return 0;
+}
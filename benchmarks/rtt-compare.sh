@@ -0,0 +1,57 @@
+#!/bin/sh
+# Compare aesdsocket round trip time over loopback TCP and UNIX sockets
+# usage: rtt-compare.sh [iterations] [rounds]
+#
+# Every round trip replays the whole log, so each transport gets a fresh
+# server with an empty log of its own, in a temporary directory, and the
+# transports take turns for the given number of rounds (default 3). The
+# TCP server listens on RTT_PORT (default 9100), not on the 9000 of a
+# server which may be running; the UNIX ones have no TCP listener.
+
+set -e
+
+ITERATIONS=${1:-1000}
+ROUNDS=${2:-3}
+PORT=${RTT_PORT:-9100}
+BENCHDIR=$(dirname $0)
+SERVERDIR=${BENCHDIR}/../server
+WORKDIR=$(mktemp -d ${TMPDIR:-/tmp}/rtt-compare.XXXXXX)
+SOCKPATH=${WORKDIR}/aesdsocket.sock
+ABSTRACT=aesdsocket-bench-$$
+SERVER_PID=
+
+make -s -C ${SERVERDIR} aesdsocket
+make -s -C ${BENCHDIR} aesdsocket-rtt
+
+trap "[ -n \"\${SERVER_PID}\" ] && kill \${SERVER_PID} 2> /dev/null; rm -rf ${WORKDIR}; true" EXIT
+
+# run_transport name "server options" "client options"
+run_transport()
+{
+    rm -f ${WORKDIR}/aesdsocketdata*
+    ${SERVERDIR}/aesdsocket -t 0 -f ${WORKDIR}/aesdsocketdata $2 > /dev/null 2>&1 &
+    SERVER_PID=$!
+    # ready once a round trip goes through
+    tries=0
+    until ${BENCHDIR}/aesdsocket-rtt -n 1 $3 > /dev/null 2>&1; do
+        tries=$((tries + 1))
+        if [ ${tries} -gt 100 ] || ! kill -0 ${SERVER_PID} 2> /dev/null; then
+            echo "aesdsocket did not start for $1" >&2
+            exit 1
+        fi
+        sleep 0.1
+    done
+    ${BENCHDIR}/aesdsocket-rtt -n ${ITERATIONS} $3
+    kill ${SERVER_PID}
+    { wait ${SERVER_PID} || true; } 2> /dev/null
+    SERVER_PID=
+}
+
+round=1
+while [ ${round} -le ${ROUNDS} ]; do
+    echo "round ${round}"
+    run_transport tcp "-p ${PORT}" "-p ${PORT}"
+    run_transport unix "-p 0 -u ${SOCKPATH}" "-u ${SOCKPATH}"
+    run_transport abstract "-p 0 -a ${ABSTRACT}" "-a ${ABSTRACT}"
+    round=$((round + 1))
+done
@@ -0,0 +1,213 @@
+/*
+  spawn-latency: cost of starting a command from a parent of a given size
+
+  usage: spawn-latency [-n iterations] [-c command] [-t threads] [rss_mb ...]
+
+  For every resident size (default 0 256 1024 MB) the parent first
+  touches that much anonymous memory, then runs the command (default
+  /bin/true) n times through do_exec() of examples/systemcalls, each
+  with another launcher set by exec_set_launcher()
+    fork    fork + execv + waitpid, the launcher do_exec replaced
+    spawn   none, the default posix_spawn + waitpid
+    zygote  that of zygote_start(), the zygote forked at startup
+  and prints min/median/p99 in microseconds. fork copies the page tables
+  of the whole parent, so its cost follows rss_mb; the others do not.
+  -t starts that many idle threads first.
+ */
+
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "systemcalls.h"
+#include "zygote.h"
+
+static double now_us(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+static int cmp_double(const void *a, const void *b)
+{
+  double x = *(const double *) a, y = *(const double *) b;
+
+  return (x > y) - (x < y);
+}
+
+// the launcher do_exec replaced
+static int fork_spawn(char *const argv[], const int fds[3])
+{
+  pid_t pid;
+  int i;
+
+  pid = fork();
+  if (pid == 0)
+    {
+      for (i = 0; i < 3; i++)
+	if (fds[i] != i && dup2(fds[i], i) == -1)
+	  _exit(127);
+      execv(argv[0], argv);
+      _exit(127);
+    }
+  return pid;
+}
+
+static int fork_wait(int handle)
+{
+  int status;
+
+  while (waitpid(handle, &status, 0) == -1)
+    if (errno != EINTR)
+      return -1;
+  return status;
+}
+
+static const struct exec_launcher fork_launcher = {
+  "fork", fork_spawn, fork_wait
+};
+
+static void *idle_thread(void *arg)
+{
+  for (;;)
+    pause();
+  return arg;
+}
+
+static void report(const char *name, size_t rss_mb, double *samples, int iterations)
+{
+  qsort(samples, iterations, sizeof *samples, cmp_double);
+  printf("%-6s rss=%zuMB n=%d min=%.1fus median=%.1fus p99=%.1fus\n",
+	 name, rss_mb, iterations, samples[0], samples[iterations / 2],
+	 samples[(int) (iterations * 0.99)]);
+}
+
+int main(int argc, char **argv)
+{
+  static const size_t default_rss[] = { 0, 256, 1024 };
+  struct {
+    const char *name;
+    const struct exec_launcher *launcher;
+  } launchers[] = {
+    { "fork", &fork_launcher },
+    { "spawn", NULL },
+    { "zygote", NULL },
+  };
+  const char *command = "/bin/true";
+  int iterations = 200;
+  int threads = 0;
+  size_t rss_mb;
+  pthread_t thread;
+  double *samples;
+  double t0;
+  char *mem;
+  int stdout_fd;
+  int devnull;
+  int nsizes;
+  int c;
+  int i;
+  int j;
+  int k;
+
+  while ((c = getopt(argc, argv, "n:c:t:")) != -1)
+    {
+      switch (c)
+	{
+	case 'n':
+	  iterations = atoi(optarg);
+	  break;
+	case 'c':
+	  command = optarg;
+	  break;
+	case 't':
+	  threads = atoi(optarg);
+	  break;
+	default:
+	  fprintf(stderr, "usage: %s [-n iterations] [-c command] [-t threads] [rss_mb ...]\n", argv[0]);
+	  return 1;
+	}
+    }
+  if (iterations < 1)
+    iterations = 1;
+  nsizes = optind < argc ? argc - optind : (int) (sizeof default_rss / sizeof *default_rss);
+
+  // while the process is still small
+  if (zygote_start() == -1)
+    {
+      perror("zygote_start error");
+      return 1;
+    }
+  launchers[2].launcher = exec_get_launcher();
+  for (i = 0; i < threads; i++)
+    {
+      if (pthread_create(&thread, NULL, idle_thread, NULL) != 0)
+	{
+	  fprintf(stderr, "could not start thread %d\n", i);
+	  return 1;
+	}
+    }
+
+  samples = malloc(iterations * sizeof *samples);
+  devnull = open("/dev/null", O_WRONLY);
+  stdout_fd = dup(STDOUT_FILENO);
+  if (samples == NULL || devnull == -1 || stdout_fd == -1)
+    {
+      perror("setup error");
+      return 1;
+    }
+
+  for (j = 0; j < nsizes; j++)
+    {
+      rss_mb = optind < argc ? strtoul(argv[optind + j], NULL, 0) : default_rss[j];
+      mem = NULL;
+      if (rss_mb > 0)
+	{
+	  mem = mmap(NULL, rss_mb << 20, PROT_READ | PROT_WRITE,
+		     MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	  if (mem == MAP_FAILED)
+	    {
+	      perror("mmap error");
+	      return 1;
+	    }
+	  memset(mem, 1, rss_mb << 20);
+	}
+
+      for (k = 0; k < (int) (sizeof launchers / sizeof *launchers); k++)
+	{
+	  // do_exec reports on stdout, keep that out of the results
+	  exec_set_launcher(launchers[k].launcher);
+	  fflush(stdout);
+	  dup2(devnull, STDOUT_FILENO);
+	  for (i = 0; i < iterations; i++)
+	    {
+	      t0 = now_us();
+	      if (!do_exec(1, command))
+		{
+		  dup2(stdout_fd, STDOUT_FILENO);
+		  fprintf(stderr, "%s failed under %s at iteration %d\n",
+			  command, launchers[k].name, i);
+		  return 1;
+		}
+	      samples[i] = now_us() - t0;
+	    }
+	  fflush(stdout);
+	  dup2(stdout_fd, STDOUT_FILENO);
+	  report(launchers[k].name, rss_mb, samples, iterations);
+	}
+      if (mem != NULL)
+	munmap(mem, rss_mb << 20);
+    }
+
+  free(samples);
+  zygote_stop();
+  return 0;
+}
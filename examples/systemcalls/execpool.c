@@ -0,0 +1,381 @@
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <sys/epoll.h>
+#include <sys/syscall.h>
+#include <signal.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include "systemcalls.h"
+#include "execpool.h"
+
+/*
+ * Runs many commands at once without a blocking wait per child.
+ *
+ * Every running child is tracked by a pidfd in one epoll set; the pidfd
+ * becomes readable when the child exits and is then reaped.  At most
+ * max_running children run at a time, the others wait in submit order.
+ * A child past its timeout gets SIGTERM, then SIGKILL once the grace
+ * time has passed as well.  Everything, the done callbacks included,
+ * runs in the thread calling exec_pool_run or exec_pool_wait; a command
+ * exec_submit fails to start is reported by the next exec_pool_run, so
+ * a done callback never runs inside exec_submit and may submit again.
+ */
+
+#ifndef SYS_pidfd_open
+#define SYS_pidfd_open 434
+#endif
+#ifndef SYS_pidfd_send_signal
+#define SYS_pidfd_send_signal 424
+#endif
+
+#define DEFAULT_GRACE_MS 1000
+#define MAX_EVENTS 64
+
+struct exec_cmd {
+    struct exec_cmd *next;
+    char **argv;            // copy of the submitted argv
+    int timeout_ms;         // 0 for none
+    exec_done_fn done;
+    void *arg;
+
+    pid_t pid;
+    int pidfd;
+    int error;              // errno of a failed start
+    double started;
+    double deadline;        // next signal is due, 0 for none
+    int signals;            // sent so far: 1 SIGTERM, 2 SIGKILL
+};
+
+struct exec_pool {
+    int epfd;
+    int max_running;
+    int grace_ms;
+    struct exec_cmd *queue;         // waiting to start, in submit order
+    struct exec_cmd **queue_tail;
+    int nqueued;
+    struct exec_cmd *running;
+    int nrunning;
+    struct exec_cmd *failed;        // could not be started, not reported yet
+    struct exec_cmd **failed_tail;
+    int nfailed;
+};
+
+static double now_seconds(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void free_cmd(struct exec_cmd *cmd)
+{
+    char **p;
+
+    for (p = cmd->argv; p && *p; p++)
+      free(*p);
+    free(cmd->argv);
+    free(cmd);
+}
+
+static void finish(struct exec_cmd *cmd, int status, int error, double now)
+{
+    struct exec_result result;
+
+    result.arg = cmd->arg;
+    result.pid = error ? -1 : cmd->pid;
+    result.status = status;
+    result.error = error;
+    result.timed_out = cmd->signals > 0;
+    result.seconds = error ? 0 : now - cmd->started;
+    if (cmd->done)
+      cmd->done(&result);
+    free_cmd(cmd);
+}
+
+/**
+ * Keep cmd, which could not be started, for report_failed.
+ */
+static void fail(struct exec_pool *pool, struct exec_cmd *cmd, int error)
+{
+    cmd->error = error;
+    cmd->next = NULL;
+    *pool->failed_tail = cmd;
+    pool->failed_tail = &cmd->next;
+    pool->nfailed++;
+}
+
+/**
+ * Report the commands which could not be started.
+ */
+static void report_failed(struct exec_pool *pool)
+{
+    struct exec_cmd *cmd;
+
+    while ((cmd = pool->failed))
+      {
+	pool->failed = cmd->next;
+	if (pool->failed == NULL)
+	  pool->failed_tail = &pool->failed;
+	pool->nfailed--;
+	finish(cmd, -1, cmd->error, cmd->started);
+      }
+}
+
+/**
+ * Start queued commands while there is room.
+ */
+static void start_queued(struct exec_pool *pool)
+{
+    struct epoll_event ev;
+    struct exec_cmd *cmd;
+    int status;
+
+    while (pool->queue && pool->nrunning < pool->max_running)
+      {
+	cmd = pool->queue;
+	pool->queue = cmd->next;
+	if (pool->queue == NULL)
+	  pool->queue_tail = &pool->queue;
+	pool->nqueued--;
+
+	cmd->started = now_seconds();
+	cmd->pid = exec_spawn(cmd->argv, NULL);
+	if (cmd->pid == -1)
+	  {
+	    fail(pool, cmd, errno);
+	    continue;
+	  }
+	cmd->pidfd = syscall(SYS_pidfd_open, cmd->pid, 0);
+	ev.events = EPOLLIN;
+	ev.data.ptr = cmd;
+	if (cmd->pidfd == -1 || epoll_ctl(pool->epfd, EPOLL_CTL_ADD, cmd->pidfd, &ev) == -1)
+	  {
+	    // no way to watch it, do not leave it running unseen
+	    status = errno;
+	    kill(cmd->pid, SIGKILL);
+	    waitpid(cmd->pid, NULL, 0);
+	    if (cmd->pidfd != -1)
+	      close(cmd->pidfd);
+	    fail(pool, cmd, status);
+	    continue;
+	  }
+	cmd->deadline = cmd->timeout_ms > 0 ? cmd->started + cmd->timeout_ms / 1e3 : 0;
+	cmd->next = pool->running;
+	pool->running = cmd;
+	pool->nrunning++;
+      }
+}
+
+/**
+ * Reap cmd, which has exited, and report it.
+ */
+static void reap(struct exec_pool *pool, struct exec_cmd *cmd)
+{
+    struct exec_cmd **p;
+    int status;
+
+    while (waitpid(cmd->pid, &status, 0) == -1 && errno == EINTR)
+      ;
+    epoll_ctl(pool->epfd, EPOLL_CTL_DEL, cmd->pidfd, NULL);
+    close(cmd->pidfd);
+    for (p = &pool->running; *p != cmd; p = &(*p)->next)
+      ;
+    *p = cmd->next;
+    pool->nrunning--;
+    finish(cmd, status, 0, now_seconds());
+}
+
+/**
+ * Signal the commands past their deadline.
+ * @return milliseconds to the next deadline, -1 if there is none
+ */
+static int expire(struct exec_pool *pool, double now)
+{
+    struct exec_cmd *cmd;
+    double next = 0;
+    int sig;
+
+    for (cmd = pool->running; cmd; cmd = cmd->next)
+      {
+	if (cmd->deadline == 0)
+	  continue;
+	if (cmd->deadline <= now)
+	  {
+	    sig = cmd->signals == 0 ? SIGTERM : SIGKILL;
+	    syscall(SYS_pidfd_send_signal, cmd->pidfd, sig, NULL, 0);
+	    cmd->signals++;
+	    cmd->deadline = sig == SIGTERM ? now + pool->grace_ms / 1e3 : 0;
+	    if (cmd->deadline == 0)
+	      continue;
+	  }
+	if (next == 0 || cmd->deadline < next)
+	  next = cmd->deadline;
+      }
+    return next == 0 ? -1 : (int) ((next - now) * 1e3) + 1;
+}
+
+/**
+ * @param max_running - How many commands may run at the same time.
+ * @return a new pool, NULL on error
+ */
+struct exec_pool *exec_pool_create(int max_running)
+{
+    struct exec_pool *pool;
+
+    pool = calloc(1, sizeof *pool);
+    if (pool == NULL)
+      return NULL;
+    pool->epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (pool->epfd == -1)
+      {
+	free(pool);
+	return NULL;
+      }
+    pool->max_running = max_running > 0 ? max_running : 1;
+    pool->grace_ms = DEFAULT_GRACE_MS;
+    pool->queue_tail = &pool->queue;
+    pool->failed_tail = &pool->failed;
+    return pool;
+}
+
+/**
+ * @param grace_ms - How long a timed out command has between SIGTERM and SIGKILL,
+ *   a negative value is taken as 0 (SIGKILL right after SIGTERM).
+ */
+void exec_pool_set_grace(struct exec_pool *pool, int grace_ms)
+{
+    // a negative deadline would make epoll_wait block forever
+    pool->grace_ms = grace_ms < 0 ? 0 : grace_ms;
+}
+
+/**
+ * Queue a command, it starts as soon as fewer than max_running run.
+ * @param argv - The full path to the command followed by its arguments,
+ *   NULL terminated, copied.
+ * @param timeout_ms - Kill the command when it runs longer, 0 for no limit.
+ * @param done - Called with the result once the command has finished or
+ *   could not be started, from exec_pool_run and never from exec_submit,
+ *   may be NULL.
+ * @return 0, -1 on error
+ */
+int exec_submit(struct exec_pool *pool, char *const argv[], int timeout_ms,
+		exec_done_fn done, void *arg)
+{
+    struct exec_cmd *cmd;
+    int count;
+    int i;
+
+    for (count = 0; argv[count]; count++)
+      ;
+    cmd = calloc(1, sizeof *cmd);
+    if (cmd == NULL)
+      return -1;
+    cmd->argv = calloc(count + 1, sizeof *cmd->argv);
+    if (cmd->argv == NULL)
+      {
+	free(cmd);
+	return -1;
+      }
+    for (i = 0; i < count; i++)
+      {
+	cmd->argv[i] = strdup(argv[i]);
+	if (cmd->argv[i] == NULL)
+	  {
+	    free_cmd(cmd);
+	    return -1;
+	  }
+      }
+    cmd->timeout_ms = timeout_ms;
+    cmd->done = done;
+    cmd->arg = arg;
+    cmd->pidfd = -1;
+
+    *pool->queue_tail = cmd;
+    pool->queue_tail = &cmd->next;
+    pool->nqueued++;
+    start_queued(pool);
+    return 0;
+}
+
+/**
+ * Handle the exits and timeouts that are due, waiting up to wait_ms for
+ * one (-1 waits until something happens).
+ * @return the number of commands queued, running or not reported yet,
+ *   -1 on error
+ */
+int exec_pool_run(struct exec_pool *pool, int wait_ms)
+{
+    struct epoll_event events[MAX_EVENTS];
+    int timeout;
+    int n;
+    int i;
+
+    start_queued(pool);
+    report_failed(pool);
+    if (pool->nrunning == 0)
+      {
+	// the queue is empty unless a done callback has submitted more
+	return pool->nqueued + pool->nfailed;
+      }
+
+    timeout = expire(pool, now_seconds());
+    if (wait_ms >= 0 && (timeout == -1 || wait_ms < timeout))
+      timeout = wait_ms;
+    n = epoll_wait(pool->epfd, events, MAX_EVENTS, timeout);
+    if (n == -1 && errno != EINTR)
+      return -1;
+    for (i = 0; i < n; i++)
+      reap(pool, events[i].data.ptr);
+    expire(pool, now_seconds());
+    start_queued(pool);
+    report_failed(pool);
+    return pool->nrunning + pool->nqueued + pool->nfailed;
+}
+
+/**
+ * Run until every submitted command has finished.
+ * @return 0, -1 on error
+ */
+int exec_pool_wait(struct exec_pool *pool)
+{
+    int ret;
+
+    while ((ret = exec_pool_run(pool, -1)) > 0)
+      ;
+    return ret;
+}
+
+/**
+ * Kill what still runs, drop what is queued or not reported and free the
+ * pool; no done callback is called for them.
+ */
+void exec_pool_destroy(struct exec_pool *pool)
+{
+    struct exec_cmd *cmd;
+
+    while ((cmd = pool->running))
+      {
+	pool->running = cmd->next;
+	kill(cmd->pid, SIGKILL);
+	waitpid(cmd->pid, NULL, 0);
+	close(cmd->pidfd);
+	free_cmd(cmd);
+      }
+    while ((cmd = pool->queue))
+      {
+	pool->queue = cmd->next;
+	free_cmd(cmd);
+      }
+    while ((cmd = pool->failed))
+      {
+	pool->failed = cmd->next;
+	free_cmd(cmd);
+      }
+    close(pool->epfd);
+    free(pool);
+}
@@ -0,0 +1,34 @@
+#ifndef EXECPOOL_H
+#define EXECPOOL_H
+
+#include <stdbool.h>
+#include <sys/types.h>
+
+/* a command finished, handed to its done callback */
+struct exec_result {
+    void *arg;              // as given to exec_submit
+    pid_t pid;              // -1 if the command could not be started
+    int status;             // wait status, -1 if the command could not be started
+    int error;              // errno of the failed start
+    bool timed_out;         // killed because it ran past its timeout
+    double seconds;         // from start to exit
+};
+
+typedef void (*exec_done_fn)(const struct exec_result *result);
+
+struct exec_pool;
+
+struct exec_pool *exec_pool_create(int max_running);
+
+void exec_pool_set_grace(struct exec_pool *pool, int grace_ms);
+
+int exec_submit(struct exec_pool *pool, char *const argv[], int timeout_ms,
+		exec_done_fn done, void *arg);
+
+int exec_pool_run(struct exec_pool *pool, int wait_ms);
+
+int exec_pool_wait(struct exec_pool *pool);
+
+void exec_pool_destroy(struct exec_pool *pool);
+
+#endif
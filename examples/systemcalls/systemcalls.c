@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include <stdlib.h>
 #include <sys/types.h>
 #include <sys/wait.h>
@@ -6,9 +7,177 @@
 #include <unistd.h>
 #include <syslog.h>
 #include <string.h>
+#include <errno.h>
 #include <stdio.h>
+#include <spawn.h>
+#include <poll.h>
 #include "systemcalls.h"
 
+extern char **environ;
+
+static const struct exec_launcher *launcher;
+
+void exec_set_launcher(const struct exec_launcher *l)
+{
+    launcher = l;
+}
+
+const struct exec_launcher *exec_get_launcher(void)
+{
+    return launcher;
+}
+
+/**
+ * Start argv[0] with arguments argv and the file actions of actions.
+ * posix_spawn starts the child on the parent's memory (vfork), so the
+ * cost does not grow with the page tables of a big parent as fork does,
+ * and an exec failure is returned here instead of as an exit status.
+ * @return the pid of the command, -1 with errno set if it could not be started
+ */
+pid_t exec_spawn(char *const argv[], const posix_spawn_file_actions_t *actions)
+{
+    pid_t pid;
+    int ret;
+
+    ret = posix_spawn(&pid, argv[0], actions, NULL, argv, environ);
+    if (ret != 0)
+      {
+	errno = ret;
+	return -1;
+      }
+    return pid;
+}
+
+/**
+ * Start command with its standard out on outfd and its standard error on
+ * errfd, -1 keeps those of the caller.  The launcher starts it when one
+ * is set, the zygote of zygote.c for one, otherwise exec_spawn.
+ * @return a handle for wait_command: the pid of the command, or the
+ *   handle of the launcher; -1 with errno set if it could not be started
+ */
+static int spawn_command(char *command[], int outfd, int errfd)
+{
+    posix_spawn_file_actions_t actions;
+    int fds[3];
+    pid_t pid;
+    int ret;
+
+    if (launcher != NULL)
+      {
+	fds[0] = STDIN_FILENO;
+	fds[1] = outfd != -1 ? outfd : STDOUT_FILENO;
+	fds[2] = errfd != -1 ? errfd : STDERR_FILENO;
+	ret = launcher->spawn(command, fds);
+	if (ret == -1)
+	  printf("%s %s: %s\n", launcher->name, command[0], strerror(errno));
+	return ret;
+      }
+
+    ret = posix_spawn_file_actions_init(&actions);
+    if (ret == 0 && outfd != -1)
+      ret = posix_spawn_file_actions_adddup2(&actions, outfd, STDOUT_FILENO);
+    if (ret == 0 && errfd != -1)
+      ret = posix_spawn_file_actions_adddup2(&actions, errfd, STDERR_FILENO);
+    pid = ret == 0 ? exec_spawn(command, &actions) : -1;
+    posix_spawn_file_actions_destroy(&actions);
+    if (pid == -1)
+      {
+	if (ret != 0)
+	  errno = ret;
+	printf("posix_spawn %s: %s\n", command[0], strerror(errno));
+	return -1;
+      }
+    printf("parent process: child process pid = %d\n", pid);
+    return pid;
+}
+
+/**
+ * @param child - As returned by spawn_command.
+ * @return the wait status of the command, -1 on error
+ */
+static int wait_command(int child)
+{
+    int status;
+
+    if (launcher != NULL)
+      {
+	status = launcher->wait(child);
+	if (status == -1)
+	  printf("%s returned on error\n", launcher->name);
+	else
+	  printf("%s returned status = %x\n", launcher->name, status);
+	return status;
+      }
+
+    while (waitpid(child, &status, 0) == -1)
+      {
+	if (errno != EINTR)
+	  {
+	    printf("child process returned on error\n");
+	    return -1;
+	  }
+      }
+    printf("waitpid returned %d, status = %x\n", child, status);
+    return status;
+}
+
+/**
+ * Start command with its standard out on outfd unless outfd is -1,
+ * and wait for it.
+ * @return the wait status of the command, -1 if it could not be started
+ */
+static int spawn_wait(char *command[], int outfd)
+{
+    int child;
+
+    child = spawn_command(command, outfd, -1);
+    if (child == -1)
+      return -1;
+    return wait_command(child);
+}
+
+/**
+ * Hand len bytes read from stream (STDOUT_FILENO or STDERR_FILENO) to
+ * the callback of cap, or append them to its buffer, up to cap->limit.
+ * @return 0, -1 if the buffer could not grow
+ */
+static int capture_data(struct exec_capture *cap, int stream, const char *data, size_t len)
+{
+    struct exec_output *out = stream == STDOUT_FILENO ? &cap->out : &cap->err;
+    size_t cap_size;
+    char *buf;
+
+    if (cap->limit && out->len + len > cap->limit)
+      {
+	len = cap->limit - out->len;
+	cap->truncated = true;
+      }
+    if (len == 0)
+      return 0;
+
+    if (cap->callback)
+      {
+	out->len += len;
+	cap->callback(stream, data, len, cap->arg);
+	return 0;
+      }
+
+    if (out->len + len + 1 > out->size)
+      {
+	for (cap_size = out->size ? out->size : 4096; cap_size < out->len + len + 1; cap_size *= 2)
+	  ;
+	buf = realloc(out->data, cap_size);
+	if (buf == NULL)
+	  return -1;
+	out->data = buf;
+	out->size = cap_size;
+      }
+    memcpy(out->data + out->len, data, len);
+    out->len += len;
+    out->data[out->len] = '\0';
+    return 0;
+}
+
 /**
  * @param cmd the command to execute with system()
  * @return true if the command in @param cmd was executed
@@ -49,14 +218,11 @@ bool do_system(const char *cmd)
 
 bool do_exec(int count, ...)
 {
-    pid_t pid;
     int status;
-    int wait_ret;
     
     va_list args;
     va_start(args, count);
     char * command[count+1];
-    char ** p;
     int i;
     for(i=0; i<count; i++)
     {
@@ -78,68 +244,29 @@ bool do_exec(int count, ...)
  *   as second argument to the execv() command.
  *
 */
-    pid = fork();
-    if (pid == -1)
+    status = spawn_wait(command, -1);
+    if (status == -1)
       return false;
-
-    if (pid == 0)
-      {// child process
-	p = &command[0];
-	execv(*p, p);
-	exit(-1);
+    if (WIFEXITED(status)) // terminated normally
+      {
+	printf("Exit status of the child was %d\n", WEXITSTATUS(status));
+	return WEXITSTATUS(status) == 0;
       }
-
-    else {
-      printf("parent process: child process pid = %d\n", pid);
-      wait_ret=waitpid(pid, &status, 0);
-      if (wait_ret == -1)
-	{
-	  printf("child process returned on error\n");
-	  return false;
-	}
-      else
-	{
-	  printf("waitpid returned %d, status = %x\n", wait_ret, status);
-	  if (wait_ret > 0)
-	    {
-	      if (WIFEXITED(status)) // terminated normally
-		{
-		  int exit_status;
-		  exit_status =  WEXITSTATUS(status);
-		  printf("Exit status of the child was %d\n", exit_status);
-		  if (exit_status == 0)
-		    return true;
-		  else
-		    return false;
-		}
-	      else
-		return false;
-	    }
-	  else if (wait_ret == 0)
-	    {
-	    printf("waitpid returned %d, status = %x\n", wait_ret, status);
-	    return false;
-	    }
-	  else
-	    {
-	    printf("waitpid returned %d, status = %x\n", wait_ret, status);
-	    return false;
-	    }
-	}
-    }
+    return false;
 }
 
 /**
 * @param outputfile - The full path to the file to write with command output.
 *   This file will be closed at completion of the function call.
 * All other parameters, see do_exec above
+* @return as do_exec: true only if the command ran and exited with 0, false
+*   also if @param outputfile could not be opened or the command could not
+*   be started
 */
 bool do_exec_redirect(const char *outputfile, int count, ...)
 {
-    pid_t pid;
     int status;
     int fd;
-    int wait_ret;
     
     va_list args;
     va_start(args, count);
@@ -165,48 +292,126 @@ bool do_exec_redirect(const char *outputfile, int count, ...)
  *
 */
     printf("outputfile = %s\n", outputfile);
-    fd = open(outputfile, O_WRONLY|O_TRUNC|O_CREAT, 0644);
+    fd = open(outputfile, O_WRONLY|O_TRUNC|O_CREAT|O_CLOEXEC, 0644);
     if (fd < 0)
       {
 	perror("open");
-	abort();
+	return false;
       }
 
-    pid = fork();
-    
-    if (pid == -1)
+    status = spawn_wait(command, fd);
+    close(fd);
+    if (status == -1)
+      return false;
+    return WIFEXITED(status) && WEXITSTATUS(status) == 0;
+}
+
+/**
+* @param cap - Where the output goes, see struct exec_capture. Set limit,
+*   callback and arg, and zero the rest before the call. The buffers of
+*   cap->out and cap->err are malloc'ed, free them with exec_capture_free.
+* All other parameters, see do_exec above
+* @return 0 if the command ran and exited with 0, 1 if it ran and failed,
+*   see cap->status, -1 with errno set if it could not be started or its
+*   output could not be collected
+*/
+int do_exec_capture(struct exec_capture *cap, int count, ...)
+{
+    struct pollfd pfd[2];
+    char buf[65536];
+    int outpipe[2] = { -1, -1 };
+    int errpipe[2] = { -1, -1 };
+    int saved_errno;
+    int ret = 0;
+    ssize_t n;
+    int child = -1;
+    int i;
+
+    va_list args;
+    va_start(args, count);
+    char * command[count+1];
+    for(i=0; i<count; i++)
+    {
+        command[i] = va_arg(args, char *);
+    }
+    command[count] = NULL;
+    va_end(args);
+
+    cap->status = -1;
+    if (pipe2(outpipe, O_CLOEXEC) == -1 || pipe2(errpipe, O_CLOEXEC) == -1)
       {
-	close(fd);
-	return -1;
+	perror("pipe2");
+	goto out;
       }
+    child = spawn_command(command, outpipe[1], errpipe[1]);
+    if (child == -1)
+      goto out;
+    // only the child writes, so both pipes end when it does
+    close(outpipe[1]);
+    close(errpipe[1]);
+    outpipe[1] = errpipe[1] = -1;
 
-    if (pid == 0)
+    // drain both, also past the limit, so the child never blocks on a full pipe
+    pfd[0].fd = outpipe[0];
+    pfd[1].fd = errpipe[0];
+    pfd[0].events = pfd[1].events = POLLIN;
+    while (pfd[0].fd != -1 || pfd[1].fd != -1)
       {
-	if (dup2(fd, 1) == -1)
+	if (poll(pfd, 2, -1) == -1)
 	  {
-	    perror("dup2");
-	    abort();
+	    if (errno == EINTR)
+	      continue;
+	    ret = -1;
+	    break;
 	  }
-	close(fd);
-	execv(command[0], command);
-	exit(-1);
-      }
-    else
-      { // parent process
-	wait_ret=waitpid(pid, &status, 0);
-	close(fd);
-	if (wait_ret == -1)
+	for (i = 0; i < 2; i++)
 	  {
-	    return false;
-	  }
-	else
-	  {
-	    printf("waitpid() returned %d\n", wait_ret);
-	    if (WIFEXITED(status))
-	      return (WEXITSTATUS(status));
-	    else
-	      return false;
+	    if (pfd[i].fd == -1 || pfd[i].revents == 0)
+	      continue;
+	    n = read(pfd[i].fd, buf, sizeof buf);
+	    if (n == -1 && errno == EINTR)
+	      continue;
+	    if (n <= 0)
+	      {
+		pfd[i].fd = -1;
+		continue;
+	      }
+	    if (ret == 0 && capture_data(cap, i == 0 ? STDOUT_FILENO : STDERR_FILENO, buf, n) == -1)
+	      ret = -1;
 	  }
       }
+
+    // reap the child even when the output was lost, closed pipes
+    // stop it if it still writes
+    close(outpipe[0]);
+    close(errpipe[0]);
+    outpipe[0] = errpipe[0] = -1;
+    cap->status = wait_command(child);
+    if (cap->status == -1)
+      ret = -1;
+    if (ret == 0)
+      ret = WIFEXITED(cap->status) && WEXITSTATUS(cap->status) == 0 ? 0 : 1;
+
+ out:
+    saved_errno = errno;
+    for (i = 0; i < 2; i++)
+      {
+	if (outpipe[i] != -1)
+	  close(outpipe[i]);
+	if (errpipe[i] != -1)
+	  close(errpipe[i]);
+      }
+    errno = saved_errno;
+    return child == -1 ? -1 : ret;
 }
 
+/**
+* Free the buffers do_exec_capture filled.
+*/
+void exec_capture_free(struct exec_capture *cap)
+{
+    free(cap->out.data);
+    free(cap->err.data);
+    memset(&cap->out, 0, sizeof cap->out);
+    memset(&cap->err, 0, sizeof cap->err);
+}
@@ -1,9 +1,55 @@
 #include <stdio.h>
 #include <stdbool.h>
 #include <stdarg.h>
+#include <stddef.h>
+#include <spawn.h>
 
 bool do_system(const char *command);
 
 bool do_exec(int count, ...);
 
 bool do_exec_redirect(const char *outputfile, int count, ...);
+
+/* one captured stream, data is nul terminated */
+struct exec_output {
+    char *data;
+    size_t len;
+    size_t size;
+};
+
+/* output of a command run by do_exec_capture */
+struct exec_capture {
+    size_t limit;           // keep at most limit bytes of each stream, 0 for all
+    // when set, the output is streamed here as it arrives instead of
+    // kept in out and err, stream is STDOUT_FILENO or STDERR_FILENO
+    void (*callback)(int stream, const char *data, size_t len, void *arg);
+    void *arg;
+
+    struct exec_output out; // standard out of the command
+    struct exec_output err; // standard error of the command
+    bool truncated;         // output beyond limit was dropped
+    int status;             // wait status of the command, -1 if not run
+};
+
+int do_exec_capture(struct exec_capture *cap, int count, ...);
+
+void exec_capture_free(struct exec_capture *cap);
+
+pid_t exec_spawn(char *const argv[], const posix_spawn_file_actions_t *actions);
+
+/* starts and waits for the commands of do_exec, do_exec_redirect and
+   do_exec_capture in place of posix_spawn and waitpid, see zygote_start */
+struct exec_launcher {
+    const char *name;
+    // fds are the standard in, out and error of the command, returns a
+    // handle for wait or -1 with errno set
+    int (*spawn)(char *const argv[], const int fds[3]);
+    // returns the wait status, -1 on error
+    int (*wait)(int handle);
+};
+
+/* NULL goes back to posix_spawn */
+void exec_set_launcher(const struct exec_launcher *launcher);
+
+/* the launcher set, NULL for posix_spawn */
+const struct exec_launcher *exec_get_launcher(void);
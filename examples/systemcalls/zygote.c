@@ -0,0 +1,412 @@
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/signalfd.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+#include <poll.h>
+#include <signal.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <spawn.h>
+#include <dirent.h>
+#include "systemcalls.h"
+#include "zygote.h"
+
+/*
+ * Zygote mode: commands are started by a helper process forked while the
+ * caller is still small, so the cost of a start does not depend on how
+ * big the caller or how many its threads have grown since.
+ *
+ * The caller sends the helper one SOCK_SEQPACKET message per command:
+ * the arguments, nul separated, and four descriptors passed with
+ * SCM_RIGHTS, the standard in, out and error of the command and the
+ * write end of a pipe for its result.  The helper starts the command
+ * with those descriptors, and writes a struct zygote_result to the pipe
+ * once it has reaped it.  Every command has its own pipe, so any number
+ * of callers and threads can have commands running at once.
+ */
+
+#ifndef SYS_close_range
+#define SYS_close_range 436
+#endif
+
+#define ZYGOTE_MSG_MAX 65536
+#define ZYGOTE_FDS 4
+#define ZYGOTE_MAX_CHILDREN 1024
+
+struct zygote_result {
+    int error;              // errno if the command could not be started
+    int status;             // its wait status otherwise
+};
+
+struct zygote_child {
+    pid_t pid;
+    int resultfd;
+};
+
+extern char **environ;
+
+static int zygote_fd = -1;
+static pid_t zygote_pid = -1;
+
+static const struct exec_launcher zygote_launcher = {
+    .name = "zygote",
+    .spawn = zygote_spawn,
+    .wait = zygote_wait,
+};
+
+static void send_result(int fd, int error, int status)
+{
+    struct zygote_result result;
+
+    result.error = error;
+    result.status = status;
+    // a pipe write this small is atomic
+    if (write(fd, &result, sizeof result) == -1)
+      {
+	// EPIPE: the caller closed its end, nobody waits for this result.
+	// SIGPIPE is ignored, so it does not kill the helper and the
+	// results of the other commands with it
+      }
+    close(fd);
+}
+
+/**
+ * Start one command from a request message.
+ * @return the pid, -1 if it could not be started, the result is sent then
+ */
+static pid_t helper_spawn(char *msg, size_t len, const int fds[ZYGOTE_FDS])
+{
+    posix_spawn_file_actions_t actions;
+    posix_spawnattr_t attr;
+    char *argv[len / 2 + 2];
+    sigset_t none;
+    sigset_t pipe;
+    size_t off;
+    pid_t pid = -1;
+    int argc = 0;
+    int i;
+
+    for (off = 0; off < len; off += strlen(msg + off) + 1)
+      argv[argc++] = msg + off;
+    argv[argc] = NULL;
+
+    // the command must not inherit the blocked SIGCHLD nor the ignored
+    // SIGPIPE of the helper
+    sigemptyset(&none);
+    sigemptyset(&pipe);
+    sigaddset(&pipe, SIGPIPE);
+    posix_spawnattr_init(&attr);
+    posix_spawnattr_setsigmask(&attr, &none);
+    posix_spawnattr_setsigdefault(&attr, &pipe);
+    posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSIGMASK | POSIX_SPAWN_SETSIGDEF);
+    posix_spawn_file_actions_init(&actions);
+    for (i = 0; i < 3; i++)
+      posix_spawn_file_actions_adddup2(&actions, fds[i], i);
+    i = argc > 0 ? posix_spawn(&pid, argv[0], &actions, &attr, argv, environ) : EINVAL;
+    posix_spawn_file_actions_destroy(&actions);
+    posix_spawnattr_destroy(&attr);
+    if (i != 0)
+      {
+	send_result(fds[3], i, -1);
+	pid = -1;
+      }
+    for (i = 0; i < 3; i++)
+      close(fds[i]);
+    return pid;
+}
+
+/**
+ * Close every descriptor from 4 up, with close_range where the kernel has
+ * it (5.9) and by listing /proc/self/fd otherwise.
+ */
+static void close_from_4(void)
+{
+    struct dirent *de;
+    DIR *dir;
+    long max;
+    int fd;
+
+    if (syscall(SYS_close_range, 4, ~0U, 0) == 0)
+      return;
+    dir = opendir("/proc/self/fd");
+    if (dir != NULL)
+      {
+	while ((de = readdir(dir)) != NULL)
+	  {
+	    fd = atoi(de->d_name);
+	    if (fd >= 4 && fd != dirfd(dir))
+	      close(fd);
+	  }
+	closedir(dir);
+	return;
+      }
+    // no /proc either
+    max = sysconf(_SC_OPEN_MAX);
+    for (fd = 4; fd < (max > 0 && max < 65536 ? max : 65536); fd++)
+      close(fd);
+}
+
+/**
+ * Main loop of the helper: start commands as requests come in, report
+ * them as they exit, leave when the caller closes the socket.
+ */
+static void helper_main(int sock)
+{
+    static struct zygote_child children[ZYGOTE_MAX_CHILDREN];
+    union {
+      char buf[CMSG_SPACE(ZYGOTE_FDS * sizeof (int))];
+      struct cmsghdr align;
+    } control;
+    char msg[ZYGOTE_MSG_MAX + 1];
+    struct signalfd_siginfo si;
+    struct pollfd pfd[2];
+    struct cmsghdr *cmsg;
+    struct msghdr mh;
+    struct iovec iov;
+    sigset_t mask;
+    int fds[ZYGOTE_FDS];
+    int nchildren = 0;
+    int status;
+    ssize_t n;
+    pid_t pid;
+    int i;
+
+    // a caller which closed its result pipe must not kill the helper
+    signal(SIGPIPE, SIG_IGN);
+
+    // only the socket and the standard descriptors are kept for the commands
+    if (sock != 3)
+      {
+	dup2(sock, 3);
+	sock = 3;
+      }
+    close_from_4();
+    fcntl(sock, F_SETFD, FD_CLOEXEC);
+
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGCHLD);
+    sigprocmask(SIG_BLOCK, &mask, NULL);
+    pfd[0].fd = sock;
+    pfd[1].fd = signalfd(-1, &mask, SFD_CLOEXEC | SFD_NONBLOCK);
+    pfd[0].events = pfd[1].events = POLLIN;
+    if (pfd[1].fd == -1)
+      _exit(1);
+
+    for (;;)
+      {
+	// no request taken while the table is full, the caller waits
+	pfd[0].events = nchildren < ZYGOTE_MAX_CHILDREN ? POLLIN : 0;
+	if (poll(pfd, 2, -1) == -1)
+	  {
+	    if (errno == EINTR)
+	      continue;
+	    _exit(1);
+	  }
+
+	if (pfd[1].revents)
+	  {
+	    while (read(pfd[1].fd, &si, sizeof si) > 0)
+	      ;
+	    while ((pid = waitpid(-1, &status, WNOHANG)) > 0)
+	      {
+		for (i = 0; i < nchildren && children[i].pid != pid; i++)
+		  ;
+		if (i == nchildren)
+		  continue;
+		send_result(children[i].resultfd, 0, status);
+		children[i] = children[--nchildren];
+	      }
+	  }
+
+	if (!pfd[0].revents)
+	  continue;
+	iov.iov_base = msg;
+	iov.iov_len = ZYGOTE_MSG_MAX;
+	memset(&mh, 0, sizeof mh);
+	mh.msg_iov = &iov;
+	mh.msg_iovlen = 1;
+	mh.msg_control = control.buf;
+	mh.msg_controllen = sizeof control.buf;
+	n = recvmsg(sock, &mh, MSG_CMSG_CLOEXEC);
+	if (n == 0 || (n == -1 && errno != EINTR && errno != EAGAIN))
+	  _exit(0);
+	if (n == -1)
+	  continue;
+
+	cmsg = CMSG_FIRSTHDR(&mh);
+	if (cmsg == NULL || cmsg->cmsg_type != SCM_RIGHTS
+	    || cmsg->cmsg_len != CMSG_LEN(ZYGOTE_FDS * sizeof (int)))
+	  {
+	    // not from zygote_spawn, drop whatever came with it
+	    for (; cmsg; cmsg = CMSG_NXTHDR(&mh, cmsg))
+	      if (cmsg->cmsg_type == SCM_RIGHTS)
+		for (i = 0; i < (int) ((cmsg->cmsg_len - CMSG_LEN(0)) / sizeof (int)); i++)
+		  close(((int *) CMSG_DATA(cmsg))[i]);
+	    continue;
+	  }
+	memcpy(fds, CMSG_DATA(cmsg), sizeof fds);
+	msg[n] = '\0';
+	if (n > 0 && msg[n - 1] == '\0')
+	  n--;
+
+	pid = helper_spawn(msg, n, fds);
+	if (pid != -1)
+	  {
+	    children[nchildren].pid = pid;
+	    children[nchildren].resultfd = fds[3];
+	    nchildren++;
+	  }
+      }
+}
+
+/**
+ * Fork the zygote. Call it early, while the process is small and has a
+ * single thread: the helper keeps a copy of the memory the caller has now.
+ * Once it runs, do_exec, do_exec_redirect and do_exec_capture start their
+ * commands through it, it is installed as their launcher.
+ * @return 0, -1 on error
+ */
+int zygote_start(void)
+{
+    int sv[2];
+    pid_t pid;
+
+    if (zygote_fd != -1)
+      return 0;
+    if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, sv) == -1)
+      return -1;
+    pid = fork();
+    if (pid == -1)
+      {
+	close(sv[0]);
+	close(sv[1]);
+	return -1;
+      }
+    if (pid == 0)
+      {
+	close(sv[0]);
+	helper_main(sv[1]);
+	_exit(0);
+      }
+    close(sv[1]);
+    zygote_fd = sv[0];
+    zygote_pid = pid;
+    exec_set_launcher(&zygote_launcher);
+    return 0;
+}
+
+/**
+ * Stop the zygote, commands it started keep running.
+ */
+void zygote_stop(void)
+{
+    if (zygote_fd == -1)
+      return;
+    exec_set_launcher(NULL);
+    close(zygote_fd);
+    waitpid(zygote_pid, NULL, 0);
+    zygote_fd = -1;
+    zygote_pid = -1;
+}
+
+bool zygote_active(void)
+{
+    return zygote_fd != -1;
+}
+
+/**
+ * Start argv[0] with arguments argv through the zygote.
+ * @param fds - Standard in, out and error of the command.
+ * @return the descriptor to pass to zygote_wait, -1 with errno set on error
+ */
+int zygote_spawn(char *const argv[], const int fds[3])
+{
+    union {
+      char buf[CMSG_SPACE(ZYGOTE_FDS * sizeof (int))];
+      struct cmsghdr align;
+    } control;
+    char msg[ZYGOTE_MSG_MAX];
+    struct cmsghdr *cmsg;
+    struct msghdr mh;
+    struct iovec iov;
+    int pipefd[2];
+    int sendfds[ZYGOTE_FDS];
+    size_t len = 0;
+    size_t n;
+    int i;
+
+    for (i = 0; argv[i]; i++)
+      {
+	n = strlen(argv[i]) + 1;
+	if (len + n > sizeof msg)
+	  {
+	    errno = E2BIG;
+	    return -1;
+	  }
+	memcpy(msg + len, argv[i], n);
+	len += n;
+      }
+    if (pipe2(pipefd, O_CLOEXEC) == -1)
+      return -1;
+
+    memcpy(sendfds, fds, 3 * sizeof (int));
+    sendfds[3] = pipefd[1];
+    iov.iov_base = msg;
+    iov.iov_len = len;
+    memset(&mh, 0, sizeof mh);
+    mh.msg_iov = &iov;
+    mh.msg_iovlen = 1;
+    mh.msg_control = control.buf;
+    mh.msg_controllen = sizeof control.buf;
+    cmsg = CMSG_FIRSTHDR(&mh);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof sendfds);
+    memcpy(CMSG_DATA(cmsg), sendfds, sizeof sendfds);
+
+    while (sendmsg(zygote_fd, &mh, MSG_NOSIGNAL) == -1)
+      {
+	if (errno != EINTR)
+	  {
+	    i = errno;
+	    close(pipefd[0]);
+	    close(pipefd[1]);
+	    errno = i;
+	    return -1;
+	  }
+      }
+    // the helper holds its own copy now
+    close(pipefd[1]);
+    return pipefd[0];
+}
+
+/**
+ * Wait for a command started by zygote_spawn, closes statusfd.
+ * @return its wait status, -1 with errno set if it could not be started
+ *   or the zygote went away
+ */
+int zygote_wait(int statusfd)
+{
+    struct zygote_result result;
+    ssize_t n;
+
+    while ((n = read(statusfd, &result, sizeof result)) == -1 && errno == EINTR)
+      ;
+    close(statusfd);
+    if (n != sizeof result)
+      {
+	errno = n == -1 ? errno : ECHILD;
+	return -1;
+      }
+    if (result.error)
+      {
+	errno = result.error;
+	return -1;
+      }
+    return result.status;
+}
@@ -0,0 +1,16 @@
+#ifndef ZYGOTE_H
+#define ZYGOTE_H
+
+#include <stdbool.h>
+
+int zygote_start(void);
+
+void zygote_stop(void);
+
+bool zygote_active(void);
+
+int zygote_spawn(char *const argv[], const int fds[3]);
+
+int zygote_wait(int statusfd);
+
+#endif
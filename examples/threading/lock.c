@@ -0,0 +1,313 @@
+#define _GNU_SOURCE
+#include "lock.h"
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+
+#define MCS_MAX_HELD 8          // MCS nodes per thread, more are allocated
+#define FUTEX_MAX_SPINS 1000    // most tries before sleeping
+
+#if defined(__x86_64__) || defined(__i386__)
+#define cpu_relax() __builtin_ia32_pause()
+#elif defined(__aarch64__) || defined(__arm__)
+#define cpu_relax() __asm__ __volatile__("yield" ::: "memory")
+#else
+#define cpu_relax() __asm__ __volatile__("" ::: "memory")
+#endif
+
+struct mcs_node {
+    struct mcs_node *next;
+    uint32_t locked;            // 1 while the node waits
+};
+
+// the nodes of the MCS locks this thread waits for or holds, bit i of
+// mcs_used is set while node i is in use.  a thread holding more MCS
+// locks at once gets the extra nodes from malloc
+static __thread struct mcs_node mcs_nodes[MCS_MAX_HELD];
+static __thread unsigned int mcs_used;
+
+static const char *const kind_names[LOCK_KINDS] = {
+    [LOCK_PTHREAD] = "pthread",
+    [LOCK_TICKET] = "ticket",
+    [LOCK_MCS] = "mcs",
+    [LOCK_FUTEX] = "futex",
+};
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static int hist_bucket(uint64_t ns)
+{
+    int b = ns ? 63 - __builtin_clzll(ns) : 0;
+
+    return b < LOCK_HIST_BUCKETS ? b : LOCK_HIST_BUCKETS - 1;
+}
+
+static long futex(uint32_t *addr, int op, uint32_t val)
+{
+    return syscall(SYS_futex, addr, op, val, NULL, NULL, 0);
+}
+
+/* return true if the lock had to be waited for */
+static bool ticket_acquire(struct lock *l)
+{
+    uint32_t me = __atomic_fetch_add(&l->u.ticket.next, 1, __ATOMIC_RELAXED);
+
+    if (__atomic_load_n(&l->u.ticket.serving, __ATOMIC_ACQUIRE) == me)
+      return false;
+    while (__atomic_load_n(&l->u.ticket.serving, __ATOMIC_ACQUIRE) != me)
+      cpu_relax();
+    return true;
+}
+
+static bool mcs_acquire(struct lock *l)
+{
+    struct mcs_node *node;
+    struct mcs_node *prev;
+    int i;
+
+    if (mcs_used == (1U << MCS_MAX_HELD) - 1)
+      {
+	node = malloc(sizeof *node);
+	if (node == NULL)
+	  abort(); // no way to report it, lock_acquire cannot fail
+      }
+    else
+      {
+	i = __builtin_ctz(~mcs_used);
+	mcs_used |= 1U << i;
+	node = &mcs_nodes[i];
+      }
+    node->next = NULL;
+    node->locked = 1;
+    prev = __atomic_exchange_n(&l->u.mcs.tail, node, __ATOMIC_ACQ_REL);
+    if (prev)
+      {
+	__atomic_store_n(&prev->next, node, __ATOMIC_RELEASE);
+	while (__atomic_load_n(&node->locked, __ATOMIC_ACQUIRE))
+	  cpu_relax();
+      }
+    l->u.mcs.owner = node;
+    return prev != NULL;
+}
+
+static void mcs_release(struct lock *l)
+{
+    struct mcs_node *node = l->u.mcs.owner;
+    struct mcs_node *next;
+    struct mcs_node *expected = node;
+
+    next = __atomic_load_n(&node->next, __ATOMIC_ACQUIRE);
+    if (next == NULL)
+      {
+	if (__atomic_compare_exchange_n(&l->u.mcs.tail, &expected, NULL, false,
+					__ATOMIC_RELEASE, __ATOMIC_RELAXED))
+	  goto out;
+	// a waiter swapped itself in and is about to link to node
+	while ((next = __atomic_load_n(&node->next, __ATOMIC_ACQUIRE)) == NULL)
+	  cpu_relax();
+      }
+    __atomic_store_n(&next->locked, 0, __ATOMIC_RELEASE);
+ out:
+    // locks may be released in any order, free the node of this one; no
+    // other thread looks at it once its successor is woken
+    if (node >= mcs_nodes && node < mcs_nodes + MCS_MAX_HELD)
+      mcs_used &= ~(1U << (node - mcs_nodes));
+    else
+      free(node);
+}
+
+/*
+ * Drepper, "Futexes Are Tricky", mutex 2, with a spin phase first. As
+ * the adaptive mutex of glibc, the spin phase lasts up to twice the tries
+ * the recent spins needed, so a lock held briefly is spun for and one
+ * held long goes to sleep at once.
+ */
+static bool futex_acquire(struct lock *l)
+{
+    int32_t spins = __atomic_load_n(&l->u.futex.spins, __ATOMIC_RELAXED);
+    int32_t max = spins * 2 + 10;
+    uint32_t c = 0;
+    int32_t i;
+
+    if (__atomic_compare_exchange_n(&l->u.futex.word, &c, 1, false,
+				    __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+      return false;
+    if (max > FUTEX_MAX_SPINS)
+      max = FUTEX_MAX_SPINS;
+    for (i = 0; i < max; i++)
+      {
+	cpu_relax();
+	c = 0;
+	if (__atomic_load_n(&l->u.futex.word, __ATOMIC_RELAXED) == 0
+	    && __atomic_compare_exchange_n(&l->u.futex.word, &c, 1, false,
+					   __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+	  break;
+      }
+    // a moving average, racy updates only blur it
+    __atomic_store_n(&l->u.futex.spins, spins + (i - spins) / 8, __ATOMIC_RELAXED);
+    if (i < max)
+      return true;
+
+    if (c != 2)
+      c = __atomic_exchange_n(&l->u.futex.word, 2, __ATOMIC_ACQUIRE);
+    while (c != 0)
+      {
+	futex(&l->u.futex.word, FUTEX_WAIT_PRIVATE, 2);
+	c = __atomic_exchange_n(&l->u.futex.word, 2, __ATOMIC_ACQUIRE);
+      }
+    return true;
+}
+
+static void futex_release(struct lock *l)
+{
+    if (__atomic_exchange_n(&l->u.futex.word, 0, __ATOMIC_RELEASE) == 2)
+      futex(&l->u.futex.word, FUTEX_WAKE_PRIVATE, 1);
+}
+
+int lock_init(struct lock *l, enum lock_kind kind, bool stats)
+{
+    memset(l, 0, sizeof *l);
+    if (kind < 0 || kind >= LOCK_KINDS)
+      {
+	errno = EINVAL;
+	return -1;
+      }
+    l->kind = kind;
+    l->acquire = lock_acquire;
+    l->release = lock_release;
+    if (kind == LOCK_PTHREAD && (errno = pthread_mutex_init(&l->u.mutex, NULL)))
+      return -1;
+    if (stats)
+      {
+	l->stats = calloc(1, sizeof *l->stats);
+	if (l->stats == NULL)
+	  {
+	    lock_destroy(l);
+	    return -1;
+	  }
+      }
+    return 0;
+}
+
+void lock_destroy(struct lock *l)
+{
+    if (l->kind == LOCK_PTHREAD)
+      pthread_mutex_destroy(&l->u.mutex);
+    free(l->stats);
+    l->stats = NULL;
+}
+
+void lock_acquire(struct lock *l)
+{
+    uint64_t start = l->stats ? now_ns() : 0;
+    uint64_t wait;
+    bool contended;
+
+    switch (l->kind)
+      {
+      case LOCK_PTHREAD:
+	contended = pthread_mutex_trylock(&l->u.mutex) != 0;
+	if (contended)
+	  pthread_mutex_lock(&l->u.mutex);
+	break;
+      case LOCK_TICKET:
+	contended = ticket_acquire(l);
+	break;
+      case LOCK_MCS:
+	contended = mcs_acquire(l);
+	break;
+      default:
+	contended = futex_acquire(l);
+	break;
+      }
+
+    // under the lock from here, the statistics need no atomics
+    if (l->stats)
+      {
+	l->acquired_ns = now_ns();
+	wait = l->acquired_ns - start;
+	l->stats->acquisitions++;
+	l->stats->contended += contended;
+	l->stats->wait_ns += wait;
+	l->stats->wait_hist[hist_bucket(wait)]++;
+      }
+}
+
+void lock_release(struct lock *l)
+{
+    uint64_t hold;
+
+    if (l->stats)
+      {
+	hold = now_ns() - l->acquired_ns;
+	l->stats->hold_ns += hold;
+	l->stats->hold_hist[hist_bucket(hold)]++;
+      }
+
+    switch (l->kind)
+      {
+      case LOCK_PTHREAD:
+	pthread_mutex_unlock(&l->u.mutex);
+	break;
+      case LOCK_TICKET:
+	__atomic_store_n(&l->u.ticket.serving, l->u.ticket.serving + 1, __ATOMIC_RELEASE);
+	break;
+      case LOCK_MCS:
+	mcs_release(l);
+	break;
+      default:
+	futex_release(l);
+	break;
+      }
+}
+
+const char *lock_kind_name(enum lock_kind kind)
+{
+    return kind >= 0 && kind < LOCK_KINDS ? kind_names[kind] : "unknown";
+}
+
+int lock_kind_parse(const char *name)
+{
+    int i;
+
+    for (i = 0; i < LOCK_KINDS; i++)
+      if (strcmp(name, kind_names[i]) == 0)
+	return i;
+    return -1;
+}
+
+static void print_hist(FILE *out, const char *name, const uint64_t *hist)
+{
+    int i;
+
+    fprintf(out, "  %s:", name);
+    for (i = 0; i < LOCK_HIST_BUCKETS; i++)
+      if (hist[i])
+	fprintf(out, " <%lluns=%llu", 2ULL << i, (unsigned long long) hist[i]);
+    fprintf(out, "\n");
+}
+
+void lock_stats_print(const struct lock *l, FILE *out)
+{
+    const struct lock_stats *s = l->stats;
+
+    if (s == NULL)
+      return;
+    fprintf(out, "%s lock: acquisitions=%llu contended=%llu avg_wait=%.0fns avg_hold=%.0fns\n",
+	    lock_kind_name(l->kind), (unsigned long long) s->acquisitions,
+	    (unsigned long long) s->contended,
+	    s->acquisitions ? (double) s->wait_ns / s->acquisitions : 0.0,
+	    s->acquisitions ? (double) s->hold_ns / s->acquisitions : 0.0);
+    print_hist(out, "wait", s->wait_hist);
+    print_hist(out, "hold", s->hold_hist);
+}
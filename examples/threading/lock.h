@@ -0,0 +1,89 @@
+#ifndef LOCK_H
+#define LOCK_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <pthread.h>
+
+/**
+ * A lock with a selectable implementation and optional contention
+ * statistics, for code which would otherwise use a bare pthread_mutex_t.
+ */
+enum lock_kind {
+    LOCK_PTHREAD,   // pthread_mutex_t
+    LOCK_TICKET,    // ticket spin lock, FIFO
+    LOCK_MCS,       // MCS queue lock, FIFO, each waiter spins on its own node
+    LOCK_FUTEX,     // spins as long as recent waits took, then sleeps on a futex
+    LOCK_KINDS
+};
+
+#define LOCK_HIST_BUCKETS 32    // bucket i counts times in [2^i, 2^(i+1)) ns
+
+struct lock_stats {
+    uint64_t acquisitions;
+    uint64_t contended;         // acquisitions which had to wait
+    uint64_t wait_ns;           // total
+    uint64_t hold_ns;           // total
+    uint64_t wait_hist[LOCK_HIST_BUCKETS];
+    uint64_t hold_hist[LOCK_HIST_BUCKETS];
+};
+
+struct mcs_node;
+
+struct lock {
+    enum lock_kind kind;
+    union {
+      pthread_mutex_t mutex;
+      struct {
+        uint32_t next;
+        uint32_t serving;
+      } ticket;
+      struct {
+        struct mcs_node *tail;
+        struct mcs_node *owner;
+      } mcs;
+      struct {
+        uint32_t word;          // 0 free, 1 locked, 2 locked with sleepers
+        int32_t spins;          // average tries the spin phase needed
+      } futex;
+    } u;
+    struct lock_stats *stats;   // NULL when not kept
+    uint64_t acquired_ns;       // written by the owner, for the hold time
+    // lock_acquire and lock_release, set by lock_init, so threading.c can
+    // take a lock without linking lock.c
+    void (*acquire)(struct lock *l);
+    void (*release)(struct lock *l);
+};
+
+/**
+* @param stats keep statistics, see lock_stats
+* @return 0, -1 on error
+*/
+int lock_init(struct lock *l, enum lock_kind kind, bool stats);
+
+void lock_destroy(struct lock *l);
+
+void lock_acquire(struct lock *l);
+
+/**
+* Release @param l, on the thread which acquired it. A thread may hold
+* several locks and release them in any order. There is no limit on the
+* number held at once, but a thread holding more than 8 MCS locks at once
+* pays a malloc and free for each one beyond the 8th.
+*/
+void lock_release(struct lock *l);
+
+const char *lock_kind_name(enum lock_kind kind);
+
+/**
+* @return the kind named @param name, -1 if there is none
+*/
+int lock_kind_parse(const char *name);
+
+/**
+* Print the statistics of @param l, nothing when it keeps none.
+*/
+void lock_stats_print(const struct lock *l, FILE *out);
+
+#endif
@@ -4,6 +4,8 @@
 #include <stdio.h>
 #include <errno.h>
 #include <pthread.h>
+#include <stdint.h>
+#include <time.h>
 
 // Optional: use these functions to add debug or error prints to your application
 #define DEBUG_LOG(msg,...)
@@ -21,7 +23,12 @@ void* threadfunc(void* thread_param)
     
     usleep(thread_func_args->wait_to_obtain_ms*1000);
     
-    ret = pthread_mutex_lock(thread_func_args->mutex);
+    if (thread_func_args->lock) {
+      thread_func_args->lock->acquire(thread_func_args->lock);
+      ret = 0;
+    }
+    else
+      ret = pthread_mutex_lock(thread_func_args->mutex);
 
     if (!ret) {
       thread_func_args->thread_complete_success = true ;
@@ -33,7 +40,12 @@ void* threadfunc(void* thread_param)
     thread_func_args->cnt+=100;
     
     usleep(thread_func_args->wait_to_release_ms*1000);
-    ret = pthread_mutex_unlock(thread_func_args->mutex);
+    if (thread_func_args->lock) {
+      thread_func_args->lock->release(thread_func_args->lock);
+      ret = 0;
+    }
+    else
+      ret = pthread_mutex_unlock(thread_func_args->mutex);
     
     if (!ret) {
       thread_func_args->thread_complete_success = true ;
@@ -62,11 +74,15 @@ bool start_thread_obtaining_mutex(pthread_t *thread, pthread_mutex_t *mutex,int
   struct thread_data * thread_param = (struct thread_data *) malloc(sizeof(struct thread_data));
   int ret;
 
-  printf("thread_param->mutex = %p\n", thread_param->mutex);
+  if (thread_param == NULL) {
+    ERROR_LOG("can not allocate thread_data");
+    return false;
+  }
   printf("param mutex = %p\n", mutex);
 
   
   thread_param->mutex = mutex;
+  thread_param->lock = NULL;
   thread_param->cnt = 0;
   thread_param->wait_to_obtain_ms = wait_to_obtain_ms;
   thread_param->wait_to_release_ms = wait_to_release_ms;
@@ -86,3 +102,498 @@ bool start_thread_obtaining_mutex(pthread_t *thread, pthread_mutex_t *mutex,int
   printf("thread created\n");
   return true;
 }
+
+bool start_thread_obtaining_lock(pthread_t *thread, struct lock *lock,int wait_to_obtain_ms, int wait_to_release_ms)
+{
+  struct thread_data * thread_param = (struct thread_data *) calloc(1, sizeof(struct thread_data));
+  int ret;
+
+  if (thread_param == NULL) {
+    ERROR_LOG("can not allocate thread_data");
+    return false;
+  }
+  thread_param->lock = lock;
+  thread_param->wait_to_obtain_ms = wait_to_obtain_ms;
+  thread_param->wait_to_release_ms = wait_to_release_ms;
+
+  ret = pthread_create(thread, NULL, threadfunc, (void *)thread_param);
+  if (ret){
+    errno = ret;
+    perror("pthread_create");
+    free(thread_param);
+    return false;
+  }
+  return true;
+}
+
+/*
+ * delay executor
+ * a request is a delayed_task in the heap of one worker, ordered by when
+ * its next step is due: first obtaining the mutex, then releasing it.
+ * both steps run on the same worker, so the mutex is unlocked by the
+ * thread which locked it.  a worker sleeps on its condition variable until
+ * the earliest step of its heap is due or a new one comes first.
+ *
+ * a task which finds its mutex busy joins the wait queue of that mutex
+ * and sleeps.  the release step of a task wakes the first in the queue,
+ * so the tasks of the executor get a contended mutex in the order they
+ * asked for it, as blocked pthread_mutex_lock callers would queue.  the
+ * first in the queue also retries on its own, backing off from 0.1ms to
+ * 10ms, for a mutex released by a thread outside the executor, which
+ * wakes nobody; such a thread may take the mutex ahead of the queue.
+ */
+
+#define DELAY_MAX_WORKERS 64
+#define DELAY_RETRY_NS 100000       // first retry of a busy mutex after 0.1ms
+#define DELAY_RETRY_MAX_NS 10000000 // doubling up to 10ms
+#define DELAY_NEVER UINT64_MAX      // due when woken only
+#define DELAY_WAIT_BUCKETS 256
+
+enum delay_step { STEP_OBTAIN, STEP_RELEASE, STEP_DONE };
+
+struct delayed_task {
+    struct thread_data data;        // first, the caller frees it as the task
+    uint64_t due;                   // CLOCK_MONOTONIC ns of the next step
+    enum delay_step step;
+    struct delay_worker *w;         // the worker running it
+    size_t pos;                     // index in the heap of w, guarded by w->lock
+    bool in_heap;
+    uint64_t woken;                 // due asked by task_wake while out of the heap
+    uint64_t retry_ns;              // next back off of a busy mutex
+    struct mutex_waiters *waiting;  // queue it is in, guarded by ex->wait_lock
+    struct delayed_task *wait_next;
+};
+
+/* the tasks waiting for one mutex, first in first out */
+struct mutex_waiters {
+    pthread_mutex_t *mutex;
+    struct delayed_task *head;
+    struct delayed_task *tail;
+    struct mutex_waiters *next;     // in the bucket
+};
+
+struct delay_worker {
+    struct delay_executor *ex;
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    struct delayed_task **heap;
+    size_t count;
+    size_t cap;
+    bool stop;
+};
+
+struct delay_executor {
+    struct delay_worker workers[DELAY_MAX_WORKERS];
+    int nworkers;
+    unsigned int next;              // worker for the next request
+    pthread_mutex_t done_lock;      // guards step == STEP_DONE
+    pthread_cond_t done_cond;
+    size_t pending;
+    pthread_mutex_t wait_lock;      // guards the wait queues, taken before a worker lock
+    struct mutex_waiters *waiters[DELAY_WAIT_BUCKETS];
+};
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* called with w->lock held, move the task at i up to its place */
+static void heap_up(struct delay_worker *w, size_t i)
+{
+    struct delayed_task *t = w->heap[i];
+
+    for (; i > 0 && w->heap[(i - 1) / 2]->due > t->due; i = (i - 1) / 2)
+      {
+	w->heap[i] = w->heap[(i - 1) / 2];
+	w->heap[i]->pos = i;
+      }
+    w->heap[i] = t;
+    t->pos = i;
+}
+
+/* called with w->lock held */
+static bool heap_push(struct delay_worker *w, struct delayed_task *t)
+{
+    struct delayed_task **heap;
+
+    if (w->count == w->cap)
+      {
+	heap = realloc(w->heap, (w->cap ? w->cap * 2 : 64) * sizeof *heap);
+	if (heap == NULL)
+	  return false;
+	w->heap = heap;
+	w->cap = w->cap ? w->cap * 2 : 64;
+      }
+    // a wake while the step ran
+    if (t->woken < t->due)
+      t->due = t->woken;
+    t->woken = DELAY_NEVER;
+    w->heap[w->count] = t;
+    t->in_heap = true;
+    heap_up(w, w->count++);
+    return true;
+}
+
+/* called with w->lock held and the heap not empty */
+static struct delayed_task *heap_pop(struct delay_worker *w)
+{
+    struct delayed_task *top = w->heap[0];
+    struct delayed_task *last = w->heap[--w->count];
+    size_t i = 0;
+    size_t child;
+
+    while ((child = 2 * i + 1) < w->count)
+      {
+	if (child + 1 < w->count && w->heap[child + 1]->due < w->heap[child]->due)
+	  child++;
+	if (last->due <= w->heap[child]->due)
+	  break;
+	w->heap[i] = w->heap[child];
+	w->heap[i]->pos = i;
+	i = child;
+      }
+    w->heap[i] = last;
+    last->pos = i;
+    top->in_heap = false;
+    top->woken = DELAY_NEVER;
+    return top;
+}
+
+/* bring the next step of t forward to due, called with ex->wait_lock held
+   so t cannot complete meanwhile */
+static void task_wake(struct delayed_task *t, uint64_t due)
+{
+    struct delay_worker *w = t->w;
+    bool first = false;
+
+    pthread_mutex_lock(&w->lock);
+    if (!t->in_heap)
+      {
+	// running, heap_push applies it
+	if (due < t->woken)
+	  t->woken = due;
+      }
+    else if (due < t->due)
+      {
+	t->due = due;
+	heap_up(w, t->pos);
+	first = t->pos == 0;
+      }
+    pthread_mutex_unlock(&w->lock);
+    if (first)
+      pthread_cond_signal(&w->cond);
+}
+
+/* the queue of mutex, created when create is set; called with
+   ex->wait_lock held, NULL if there is none */
+static struct mutex_waiters *waiters_find(struct delay_executor *ex, pthread_mutex_t *mutex,
+                                          bool create)
+{
+    struct mutex_waiters **b = &ex->waiters[((uintptr_t) mutex >> 4) % DELAY_WAIT_BUCKETS];
+    struct mutex_waiters *q;
+
+    for (q = *b; q; q = q->next)
+      if (q->mutex == mutex)
+	return q;
+    if (!create)
+      return NULL;
+    q = calloc(1, sizeof *q);
+    if (q == NULL)
+      return NULL;
+    q->mutex = mutex;
+    q->next = *b;
+    *b = q;
+    return q;
+}
+
+/* t, first in q, has the mutex: take it out, the next one starts to
+   retry.  called with ex->wait_lock held */
+static void waiters_pop(struct delay_executor *ex, struct mutex_waiters *q, struct delayed_task *t)
+{
+    struct mutex_waiters **b;
+
+    q->head = t->wait_next;
+    t->waiting = NULL;
+    t->wait_next = NULL;
+    if (q->head)
+      {
+	task_wake(q->head, now_ns() + DELAY_RETRY_NS);
+	return;
+      }
+    for (b = &ex->waiters[((uintptr_t) q->mutex >> 4) % DELAY_WAIT_BUCKETS]; *b != q; b = &(*b)->next)
+      ;
+    *b = q->next;
+    free(q);
+}
+
+static void task_complete(struct delay_executor *ex, struct delayed_task *t)
+{
+    pthread_mutex_lock(&ex->done_lock);
+    t->step = STEP_DONE;
+    ex->pending--;
+    pthread_cond_broadcast(&ex->done_cond);
+    pthread_mutex_unlock(&ex->done_lock);
+}
+
+/* run the step of t which is due, return true if it has a next one */
+static bool task_run(struct delay_executor *ex, struct delayed_task *t)
+{
+    struct mutex_waiters *q;
+    int ret;
+
+    if (t->step == STEP_OBTAIN)
+      {
+	pthread_mutex_lock(&ex->wait_lock);
+	q = t->waiting;
+	// behind others of the executor: wait for the release which wakes it
+	if (q && q->head != t)
+	  {
+	    pthread_mutex_unlock(&ex->wait_lock);
+	    t->due = DELAY_NEVER;
+	    return true;
+	  }
+	// tried under wait_lock: a release after it finds t in the queue
+	ret = pthread_mutex_trylock(t->data.mutex);
+	if (ret == EBUSY)
+	  {
+	    if (q == NULL && (q = waiters_find(ex, t->data.mutex, true)) != NULL)
+	      {
+		if (q->tail)
+		  q->tail->wait_next = t;
+		else
+		  q->head = t;
+		q->tail = t;
+		t->waiting = q;
+	      }
+	    // the first retries on its own, for a release outside the executor
+	    t->due = q == NULL || q->head == t ? now_ns() + t->retry_ns : DELAY_NEVER;
+	    if (t->retry_ns < DELAY_RETRY_MAX_NS)
+	      t->retry_ns *= 2;
+	    pthread_mutex_unlock(&ex->wait_lock);
+	    return true;
+	  }
+	if (q)
+	  waiters_pop(ex, q, t);
+	pthread_mutex_unlock(&ex->wait_lock);
+	if (ret)
+	  {
+	    ERROR_LOG("can not obtain lock: %d", ret);
+	    task_complete(ex, t);
+	    return false;
+	  }
+	t->data.thread_complete_success = true;
+	t->data.cnt += 100;
+	t->due = now_ns() + (uint64_t) t->data.wait_to_release_ms * 1000000;
+	t->step = STEP_RELEASE;
+	return true;
+      }
+
+    ret = pthread_mutex_unlock(t->data.mutex);
+    t->data.thread_complete_success = !ret;
+    // hand over to the first waiting task
+    pthread_mutex_lock(&ex->wait_lock);
+    q = waiters_find(ex, t->data.mutex, false);
+    if (q)
+      task_wake(q->head, now_ns());
+    pthread_mutex_unlock(&ex->wait_lock);
+    task_complete(ex, t);
+    return false;
+}
+
+static void *delay_worker_main(void *arg)
+{
+    struct delay_worker *w = arg;
+    struct delay_executor *ex = w->ex;
+    struct delayed_task *t;
+    struct timespec ts;
+    uint64_t now;
+    bool ret;
+
+    pthread_mutex_lock(&w->lock);
+    while (!w->stop || w->count > 0)
+      {
+	if (w->count == 0 || w->heap[0]->due == DELAY_NEVER)
+	  {
+	    pthread_cond_wait(&w->cond, &w->lock);
+	    continue;
+	  }
+	now = now_ns();
+	if (w->heap[0]->due > now)
+	  {
+	    ts.tv_sec = w->heap[0]->due / 1000000000;
+	    ts.tv_nsec = w->heap[0]->due % 1000000000;
+	    pthread_cond_timedwait(&w->cond, &w->lock, &ts);
+	    continue;
+	  }
+
+	t = heap_pop(w);
+	pthread_mutex_unlock(&w->lock);
+	ret = task_run(ex, t);
+	pthread_mutex_lock(&w->lock);
+	// cannot fail, the heap has room for t since it was taken from it
+	if (ret)
+	  heap_push(w, t);
+      }
+    pthread_mutex_unlock(&w->lock);
+    return NULL;
+}
+
+struct delay_executor *delay_executor_create(int nworkers)
+{
+  struct delay_executor *ex;
+  pthread_condattr_t attr;
+  int started;
+  int ret;
+  int i;
+
+  if (nworkers <= 0)
+    nworkers = sysconf(_SC_NPROCESSORS_ONLN);
+  if (nworkers <= 0)
+    nworkers = 1;
+  if (nworkers > DELAY_MAX_WORKERS)
+    nworkers = DELAY_MAX_WORKERS;
+
+  ex = calloc(1, sizeof *ex);
+  if (ex == NULL)
+    return NULL;
+  ex->nworkers = nworkers;
+  pthread_mutex_init(&ex->done_lock, NULL);
+  pthread_cond_init(&ex->done_cond, NULL);
+  pthread_mutex_init(&ex->wait_lock, NULL);
+
+  // deadlines are CLOCK_MONOTONIC, wall clock jumps do not move them
+  pthread_condattr_init(&attr);
+  pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+  for (started = 0; started < nworkers; started++)
+    {
+      ex->workers[started].ex = ex;
+      pthread_mutex_init(&ex->workers[started].lock, NULL);
+      pthread_cond_init(&ex->workers[started].cond, &attr);
+    }
+  pthread_condattr_destroy(&attr);
+
+  for (started = 0; started < nworkers; started++)
+    {
+      ret = pthread_create(&ex->workers[started].thread, NULL, delay_worker_main,
+                           &ex->workers[started]);
+      if (ret)
+	{
+	  errno = ret;
+	  perror("pthread_create");
+	  break;
+	}
+    }
+  if (started == 0)
+    {
+      for (started = 0; started < nworkers; started++)
+	{
+	  pthread_mutex_destroy(&ex->workers[started].lock);
+	  pthread_cond_destroy(&ex->workers[started].cond);
+	}
+      pthread_mutex_destroy(&ex->done_lock);
+      pthread_cond_destroy(&ex->done_cond);
+      pthread_mutex_destroy(&ex->wait_lock);
+      free(ex);
+      return NULL;
+    }
+  // the workers which did not start hold nothing but their lock and cond
+  for (i = started; i < nworkers; i++)
+    {
+      pthread_mutex_destroy(&ex->workers[i].lock);
+      pthread_cond_destroy(&ex->workers[i].cond);
+    }
+  ex->nworkers = started;
+  return ex;
+}
+
+bool schedule_obtaining_mutex(struct delay_executor *ex, struct thread_data **task,
+                              pthread_mutex_t *mutex, int wait_to_obtain_ms, int wait_to_release_ms)
+{
+  struct delayed_task *t;
+  struct delay_worker *w;
+  bool first;
+
+  t = calloc(1, sizeof *t);
+  if (t == NULL)
+    {
+      ERROR_LOG("can not allocate task");
+      return false;
+    }
+  t->data.mutex = mutex;
+  t->data.wait_to_obtain_ms = wait_to_obtain_ms;
+  t->data.wait_to_release_ms = wait_to_release_ms;
+  t->data.thread_complete_success = false;
+  t->due = now_ns() + (uint64_t) wait_to_obtain_ms * 1000000;
+  t->step = STEP_OBTAIN;
+  t->woken = DELAY_NEVER;
+  t->retry_ns = DELAY_RETRY_NS;
+
+  pthread_mutex_lock(&ex->done_lock);
+  ex->pending++;
+  pthread_mutex_unlock(&ex->done_lock);
+
+  w = &ex->workers[__atomic_fetch_add(&ex->next, 1, __ATOMIC_RELAXED) % ex->nworkers];
+  t->w = w;
+  pthread_mutex_lock(&w->lock);
+  if (!heap_push(w, t))
+    {
+      pthread_mutex_unlock(&w->lock);
+      task_complete(ex, t);
+      free(t);
+      ERROR_LOG("can not queue task");
+      return false;
+    }
+  // only a new earliest step changes how long the worker sleeps
+  first = w->heap[0] == t;
+  pthread_mutex_unlock(&w->lock);
+  if (first)
+    pthread_cond_signal(&w->cond);
+
+  *task = &t->data;
+  return true;
+}
+
+struct thread_data *delay_executor_join(struct delay_executor *ex, struct thread_data *task)
+{
+  struct delayed_task *t = (struct delayed_task *) task;
+
+  pthread_mutex_lock(&ex->done_lock);
+  while (t->step != STEP_DONE)
+    pthread_cond_wait(&ex->done_cond, &ex->done_lock);
+  pthread_mutex_unlock(&ex->done_lock);
+  return task;
+}
+
+void delay_executor_destroy(struct delay_executor *ex)
+{
+  int i;
+
+  pthread_mutex_lock(&ex->done_lock);
+  while (ex->pending > 0)
+    pthread_cond_wait(&ex->done_cond, &ex->done_lock);
+  pthread_mutex_unlock(&ex->done_lock);
+
+  for (i = 0; i < ex->nworkers; i++)
+    {
+      pthread_mutex_lock(&ex->workers[i].lock);
+      ex->workers[i].stop = true;
+      pthread_cond_signal(&ex->workers[i].cond);
+      pthread_mutex_unlock(&ex->workers[i].lock);
+      pthread_join(ex->workers[i].thread, NULL);
+    }
+  for (i = 0; i < ex->nworkers; i++)
+    {
+      free(ex->workers[i].heap);
+      pthread_mutex_destroy(&ex->workers[i].lock);
+      pthread_cond_destroy(&ex->workers[i].cond);
+    }
+  pthread_mutex_destroy(&ex->done_lock);
+  pthread_cond_destroy(&ex->done_cond);
+  pthread_mutex_destroy(&ex->wait_lock);
+  free(ex);
+}
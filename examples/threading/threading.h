@@ -1,5 +1,6 @@
 #include <stdbool.h>
 #include <pthread.h>
+#include "lock.h"
 
 /**
  * This structure should be dynamically allocated and passed as
@@ -16,6 +17,7 @@ struct thread_data{
      */
   //pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
   pthread_mutex_t * mutex;
+  struct lock * lock;     // used instead of mutex when set, see lock.h
   int cnt;
   int wait_to_obtain_ms;
   int wait_to_release_ms;
@@ -45,3 +47,51 @@ struct thread_data{
 */
 bool start_thread_obtaining_mutex(pthread_t *thread, pthread_mutex_t *mutex,int wait_to_obtain_ms, int wait_to_release_ms);
 
+/**
+* Like start_thread_obtaining_mutex, with a lock of lock.h, so its contention
+* statistics show how long the threads waited for and held it.
+*/
+bool start_thread_obtaining_lock(pthread_t *thread, struct lock *lock,int wait_to_obtain_ms, int wait_to_release_ms);
+
+
+/**
+ * Runs the same wait, obtain, hold, release sequence as
+ * start_thread_obtaining_mutex without a thread per request: a fixed pool
+ * of workers, each with a heap of tasks ordered by when their next step
+ * is due.  A pending request costs one small allocation instead of a
+ * thread stack, so the number of requests is limited only by memory.
+ */
+struct delay_executor;
+
+/**
+* @param nworkers the number of worker threads, 0 for one per cpu
+* @return the executor, NULL on error
+*/
+struct delay_executor *delay_executor_create(int nworkers);
+
+/**
+* Like start_thread_obtaining_mutex, on the workers of @param ex.
+* The mutex is taken with pthread_mutex_trylock and released by the worker
+* which took it.  Requests which find it busy queue for it and get it in
+* the order they asked, when an earlier request of @param ex releases it.
+* A thread outside the executor holding it is waited for with a retry
+* backing off from 0.1ms to 10ms, and may take it ahead of the queue.
+* @param task is filled with the thread_data of the request, to pass to
+* delay_executor_join.
+* @return true if the request was queued, false if a failure occurred.
+*/
+bool schedule_obtaining_mutex(struct delay_executor *ex, struct thread_data **task,
+                              pthread_mutex_t *mutex, int wait_to_obtain_ms, int wait_to_release_ms);
+
+/**
+* Wait for @param task to complete, like pthread_join does for a thread of
+* start_thread_obtaining_mutex.
+* @return @param task, to check thread_complete_success and to free
+*/
+struct thread_data *delay_executor_join(struct delay_executor *ex, struct thread_data *task);
+
+/**
+* Wait for every queued request to complete, then stop the workers and free
+* the executor. The thread_data of the requests are not freed.
+*/
+void delay_executor_destroy(struct delay_executor *ex);
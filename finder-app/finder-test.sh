@@ -58,10 +58,16 @@ fi
 # make clean
 # make
 
-for i in $( seq 1 $NUMFILES)
+# the first file with writer writefile writestr, the others from one
+# writer process fed a manifest of nul ended records
+if [ $NUMFILES -ge 1 ]
+then
+	${RUNDIR}/writer "$WRITEDIR/${username}1.txt" "$WRITESTR"
+fi
+for i in $( seq 2 $NUMFILES)
 do
-	${RUNDIR}/writer "$WRITEDIR/${username}$i.txt" "$WRITESTR"
-done
+	printf '%s\0%s\0' "$WRITEDIR/${username}$i.txt" "$WRITESTR"
+done | ${RUNDIR}/writer -b -
 
 OUTPUTSTRING=$(${RUNDIR}/finder.sh "$WRITEDIR" "$WRITESTR")
 
@@ -0,0 +1,474 @@
+#define _GNU_SOURCE
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <fcntl.h>
+#include <dirent.h>   // DT_*
+#include <unistd.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include "finder.h"
+/* finder.c
+   parameter1 filesdir
+   parameter2 searchstr
+
+   prints the same line as finder.sh:
+   "The number of files are X and the number of matching lines are Y"
+   X counts the entries of filesdir like ls $1 | wc -l, Y counts the lines
+   holding searchstr, ignoring case, in all files below filesdir like
+   grep -rin $2 $1 | wc -l.  searchstr is a plain string, not a regular
+   expression, and like grep binary files (a nul byte in their first
+   32 KB) and symbolic links met on the way count nothing.
+
+   the tree is walked by one thread per cpu, each with its own queue of
+   directories and files; an idle thread steals from the others.
+
+   index mode: finder -x index [-n | -u] filesdir searchstr
+   answers from a trigram index of filesdir, only the files holding every
+   trigram of searchstr are searched.  when a directory of the index has
+   another mtime the index is brought up to date first, reading again
+   only the files whose size or mtime changed; -u does so whatever the
+   directories, for files rewritten in place, and -n never does and
+   trusts the index.  finder -x index -w filesdir keeps the index up to
+   date as the tree changes, see findindex.c
+
+   return 1 if missing arguments or filesdir is not a directory
+*/
+
+struct worker {
+  struct search *s;
+  int id;
+  unsigned long matches;
+  unsigned char *buf;         // READ_MAX bytes for the small files
+};
+
+typedef unsigned char v16 __attribute__((vector_size(16)));
+
+unsigned char fold[256];
+
+int push(struct deque *q, char *path, int isdir)
+{
+  struct item *items;
+
+  pthread_mutex_lock(&q->lock);
+  if (q->tail == q->cap) {
+    // move the live part down first, grow only when it is really full
+    if (q->head > 0) {
+      memmove(q->items, q->items + q->head, (q->tail - q->head) * sizeof *q->items);
+      q->tail -= q->head;
+      q->head = 0;
+    }
+    if (q->tail == q->cap) {
+      items = realloc(q->items, (q->cap ? q->cap * 2 : 1024) * sizeof *items);
+      if (items == NULL) {
+	pthread_mutex_unlock(&q->lock);
+	return -1;
+      }
+      q->items = items;
+      q->cap = q->cap ? q->cap * 2 : 1024;
+    }
+  }
+  q->items[q->tail].path = path;
+  q->items[q->tail].isdir = isdir;
+  q->tail++;
+  pthread_mutex_unlock(&q->lock);
+  return 0;
+}
+
+int pop(struct deque *q, struct item *it, int steal)
+{
+  int found = 0;
+
+  pthread_mutex_lock(&q->lock);
+  if (q->head < q->tail) {
+    *it = steal ? q->items[q->head++] : q->items[--q->tail];
+    found = 1;
+  }
+  pthread_mutex_unlock(&q->lock);
+  return found;
+}
+
+/* count the lines of buf holding pat, ignoring ascii case.
+   candidates are found 16 positions at a time by comparing the first and
+   the last byte of pat, only those are checked in full */
+unsigned long count_matches(const unsigned char *buf, size_t len,
+			    const unsigned char *pat, size_t m)
+{
+  unsigned long count = 0;
+  const unsigned char *nl;
+  size_t end, limit;
+  size_t i, k;
+  unsigned char first, last, first_or, last_or;
+  uint64_t any[2];
+  v16 vfirst, vlast, a, b, hit;
+
+  if (m == 0) {
+    // every line matches
+    for (nl = buf; (nl = memchr(nl, '\n', buf + len - nl)) != NULL; nl++)
+      count++;
+    return count + (len > 0 && buf[len - 1] != '\n');
+  }
+  if (len < m)
+    return 0;
+
+  // letters compare with their case bit forced on, anything else as is
+  first = pat[0];
+  last = pat[m - 1];
+  first_or = (first >= 'a' && first <= 'z') ? 0x20 : 0;
+  last_or = (last >= 'a' && last <= 'z') ? 0x20 : 0;
+  for (k = 0; k < 16; k++) {
+    vfirst[k] = first;
+    vlast[k] = last;
+  }
+
+  end = len - m + 1; // possible start positions
+  i = 0;
+  while (i < end) {
+    // skip the blocks without a candidate
+    for (; i + 16 <= end; i += 16) {
+      memcpy(&a, buf + i, 16);
+      memcpy(&b, buf + i + m - 1, 16);
+      hit = (v16) (((a | first_or) == vfirst) & ((b | last_or) == vlast));
+      memcpy(any, &hit, 16);
+      if (any[0] | any[1])
+	break;
+    }
+
+    // check the candidates of this block, or of the short rest, in full
+    limit = i + 16 < end ? i + 16 : end;
+    for (; i < limit; i++) {
+      if ((buf[i] | first_or) != first || (buf[i + m - 1] | last_or) != last)
+	continue;
+      for (k = 1; k + 1 < m && fold[buf[i + k]] == pat[k]; k++)
+	;
+      if (k + 1 >= m)
+	break;
+    }
+    if (i == limit)
+      continue;
+
+    // a match, the rest of its line does not count again
+    count++;
+    nl = memchr(buf + i + m, '\n', len - i - m);
+    if (nl == NULL)
+      break;
+    i = nl - buf + 1;
+  }
+  return count;
+}
+
+unsigned long search_file(const char *path, struct worker *w)
+{
+  struct stat st;
+  unsigned char *map;
+  unsigned long count = 0;
+  size_t len;
+  ssize_t n;
+  int fd;
+
+  fd = open(path, O_RDONLY | O_NOFOLLOW);
+  if (fd == -1)
+    return 0;
+  if (fstat(fd, &st) == -1 || !S_ISREG(st.st_mode) || st.st_size == 0) {
+    close(fd);
+    return 0;
+  }
+
+  if (st.st_size <= READ_MAX) {
+    for (len = 0; len < (size_t) st.st_size; len += n) {
+      n = read(fd, w->buf + len, st.st_size - len);
+      if (n <= 0)
+	break;
+    }
+    close(fd);
+    map = w->buf;
+  }
+  else {
+    len = st.st_size;
+    map = mmap(NULL, len, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+      perror("mmap");
+      return 0;
+    }
+    madvise(map, len, MADV_SEQUENTIAL);
+  }
+
+  if (memchr(map, '\0', len < BINARY_PROBE ? len : BINARY_PROBE) == NULL)
+    count = count_matches(map, len, w->s->pat, w->s->patlen);
+  if (map != w->buf)
+    munmap(map, len);
+  return count;
+}
+
+/* queue every directory and regular file in path on q */
+void scan_dir(const char *path, struct search *s, struct deque *q)
+{
+  struct linux_dirent64 *d;
+  struct stat st;
+  char *buf;
+  char *child;
+  size_t plen = strlen(path);
+  long n, off;
+  int isdir;
+  int fd;
+
+  fd = open(path, O_RDONLY | O_DIRECTORY);
+  if (fd == -1)
+    return;
+  buf = malloc(DIRENT_BUF);
+  while (buf != NULL && (n = syscall(SYS_getdents64, fd, buf, DIRENT_BUF)) > 0) {
+    for (off = 0; off < n; off += d->d_reclen) {
+      d = (struct linux_dirent64 *) (buf + off);
+      if (strcmp(d->d_name, ".") == 0 || strcmp(d->d_name, "..") == 0)
+	continue;
+      // some file systems leave the type to a stat
+      if (d->d_type == DT_UNKNOWN) {
+	if (fstatat(fd, d->d_name, &st, AT_SYMLINK_NOFOLLOW) == -1)
+	  continue;
+	d->d_type = S_ISDIR(st.st_mode) ? DT_DIR : S_ISREG(st.st_mode) ? DT_REG : DT_LNK;
+      }
+      if (d->d_type != DT_DIR && d->d_type != DT_REG)
+	continue;
+      isdir = d->d_type == DT_DIR;
+
+      child = malloc(plen + strlen(d->d_name) + 2);
+      if (child == NULL)
+	continue;
+      sprintf(child, "%s/%s", path, d->d_name);
+      __atomic_add_fetch(&s->pending, 1, __ATOMIC_RELAXED);
+      if (push(q, child, isdir) == -1) {
+	__atomic_sub_fetch(&s->pending, 1, __ATOMIC_RELAXED);
+	free(child);
+      }
+    }
+  }
+  free(buf);
+  close(fd);
+}
+
+void *worker_main(void *arg)
+{
+  struct worker *w = arg;
+  struct search *s = w->s;
+  struct item it;
+  int found;
+  int i;
+
+  w->buf = malloc(READ_MAX);
+  if (w->buf == NULL) {
+    perror("malloc");
+    return NULL;
+  }
+  for (;;) {
+    found = pop(&s->queues[w->id], &it, 0);
+    for (i = 1; !found && i < s->nthreads; i++)
+      found = pop(&s->queues[(w->id + i) % s->nthreads], &it, 1);
+
+    if (!found) {
+      if (__atomic_load_n(&s->pending, __ATOMIC_ACQUIRE) == 0)
+	break;
+      sched_yield();
+      continue;
+    }
+
+    if (it.isdir)
+      scan_dir(it.path, s, &s->queues[w->id]);
+    else
+      w->matches += search_file(it.path, w);
+    free(it.path);
+    __atomic_sub_fetch(&s->pending, 1, __ATOMIC_RELEASE);
+  }
+  free(w->buf);
+  return NULL;
+}
+
+/* entries of dir as ls shows them: all but the hidden ones */
+long count_entries(const char *dir)
+{
+  struct linux_dirent64 *d;
+  char buf[DIRENT_BUF];
+  long count = 0;
+  long n, off;
+  int fd;
+
+  fd = open(dir, O_RDONLY | O_DIRECTORY);
+  if (fd == -1)
+    return 0;
+  while ((n = syscall(SYS_getdents64, fd, buf, sizeof buf)) > 0) {
+    for (off = 0; off < n; off += d->d_reclen) {
+      d = (struct linux_dirent64 *) (buf + off);
+      if (d->d_name[0] != '.')
+	count++;
+    }
+  }
+  close(fd);
+  return count;
+}
+
+void fold_init(void)
+{
+  int i;
+
+  for (i = 0; i < 256; i++)
+    fold[i] = (i >= 'A' && i <= 'Z') ? i | 0x20 : i;
+}
+
+int search_init(struct search *s, const char *searchstr)
+{
+  long nthreads;
+  size_t i;
+
+  fold_init();
+  memset(s, 0, sizeof *s);
+  s->patlen = strlen(searchstr);
+  s->pat = malloc(s->patlen + 1);
+  if (s->pat == NULL) {
+    perror("malloc");
+    return -1;
+  }
+  for (i = 0; i <= s->patlen; i++)
+    s->pat[i] = fold[(unsigned char) searchstr[i]];
+
+  nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+  if (nthreads < 1)
+    nthreads = 1;
+  if (nthreads > MAX_THREADS)
+    nthreads = MAX_THREADS;
+  s->nthreads = nthreads;
+  for (i = 0; i < (size_t) nthreads; i++)
+    pthread_mutex_init(&s->queues[i].lock, NULL);
+  return 0;
+}
+
+int search_add(struct search *s, char *path, int isdir)
+{
+  s->pending++;
+  if (push(&s->queues[s->pending % s->nthreads], path, isdir) == -1) {
+    s->pending--;
+    return -1;
+  }
+  return 0;
+}
+
+unsigned long search_run(struct search *s)
+{
+  pthread_t threads[MAX_THREADS];
+  struct worker workers[MAX_THREADS];
+  unsigned long matches;
+  int started;
+  int ret;
+
+  // the calling thread is worker 0
+  for (started = 0; started < s->nthreads; started++) {
+    workers[started].s = s;
+    workers[started].id = started;
+    workers[started].matches = 0;
+    if (started == 0)
+      continue;
+    ret = pthread_create(&threads[started], NULL, worker_main, &workers[started]);
+    if (ret) {
+      errno = ret;
+      perror("pthread_create");
+      break;
+    }
+  }
+  worker_main(&workers[0]);
+  matches = workers[0].matches;
+  while (--started > 0) {
+    pthread_join(threads[started], NULL);
+    matches += workers[started].matches;
+  }
+  return matches;
+}
+
+void search_free(struct search *s)
+{
+  int i;
+
+  for (i = 0; i < s->nthreads; i++) {
+    free(s->queues[i].items);
+    pthread_mutex_destroy(&s->queues[i].lock);
+  }
+  free(s->pat);
+}
+
+int main(int argc, char **argv)
+{
+  struct search s;
+  struct stat st;
+  unsigned long matches;
+  const char *index = NULL;
+  char *root;
+  size_t i;
+  int update = INDEX_CHECK;
+  int watch = 0;
+  int c;
+
+  // "+": searchstr may start with a '-'
+  while ((c = getopt(argc, argv, "+x:nuw")) != -1) {
+    if (c == 'x')
+      index = optarg;
+    else if (c == 'n')
+      update = INDEX_TRUST;
+    else if (c == 'u')
+      update = INDEX_UPDATE;
+    else if (c == 'w')
+      watch = 1;
+    else {
+      printf("usage: finder [-x index [-n | -u | -w]] filesdir searchstr\n");
+      return 1;
+    }
+  }
+  argc -= optind - 1;
+  argv += optind - 1;
+
+  if (index != NULL && watch) {
+    if (argc < 2) {
+      printf("Missing filedir\n");
+      return 1;
+    }
+  }
+  else if (argc < 3) {
+    if (argc < 2)
+      printf("Mising both filedir and searchstr arguments\n");
+    else
+      printf("Missing searchstr \n");
+    return 1;
+  }
+  if (stat(argv[1], &st) == -1 || !S_ISDIR(st.st_mode)) {
+    printf("%s is not a directory\n", argv[1]);
+    return 1;
+  }
+
+  if (index != NULL && watch)
+    return index_watch(index, argv[1]);
+  if (index != NULL)
+    return index_query(index, argv[1], argv[2], update);
+
+  if (search_init(&s, argv[2]) == -1)
+    return 1;
+  root = strdup(argv[1]);
+  if (root == NULL) {
+    perror("malloc");
+    return 1;
+  }
+
+  // strip trailing slashes, the paths below are built as root/name
+  for (i = strlen(root); i > 1 && root[i - 1] == '/'; i--)
+    root[i - 1] = '\0';
+  search_add(&s, root, 1);
+  matches = search_run(&s);
+
+  printf("The number of files are %ld and the number of matching lines are %lu\n",
+	 count_entries(argv[1]), matches);
+
+  search_free(&s);
+  return 0;
+}
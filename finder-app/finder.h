@@ -0,0 +1,69 @@
+/* finder.h: the parallel search of finder.c, shared with the index of
+   findindex.c */
+#ifndef FINDER_H
+#define FINDER_H
+
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define MAX_THREADS 64
+#define DIRENT_BUF (64 * 1024)
+#define BINARY_PROBE (32 * 1024)  // grep decides on the first buffer too
+#define READ_MAX (256 * 1024)     // smaller files are read, mapping them costs more
+
+struct linux_dirent64 {
+  uint64_t d_ino;
+  int64_t d_off;
+  unsigned short d_reclen;
+  unsigned char d_type;
+  char d_name[];
+};
+
+struct item {
+  char *path;
+  int isdir;
+};
+
+/* work queue of one thread: the owner pushes and pops at the tail,
+   thieves take from the head, the oldest and so biggest subtrees */
+struct deque {
+  pthread_mutex_t lock;
+  struct item *items;
+  size_t head;
+  size_t tail;
+  size_t cap;
+};
+
+struct search {
+  unsigned char *pat;         // searchstr folded to lower case
+  size_t patlen;
+  int nthreads;
+  struct deque queues[MAX_THREADS];
+  long pending;               // items queued and not yet done
+};
+
+/* ascii lower case of every byte */
+extern unsigned char fold[256];
+void fold_init(void);
+
+int search_init(struct search *s, const char *searchstr);
+/* queue a directory to walk or a file to search, path is malloc'ed */
+int search_add(struct search *s, char *path, int isdir);
+/* search everything queued, return the number of matching lines */
+unsigned long search_run(struct search *s);
+void search_free(struct search *s);
+
+unsigned long count_matches(const unsigned char *buf, size_t len,
+			    const unsigned char *pat, size_t m);
+long count_entries(const char *dir);
+
+/* findindex.c: finder -x index [-n | -u | -w] filesdir [searchstr] */
+/* how index_query brings the index up to date first */
+#define INDEX_TRUST 0             // -n, not at all
+#define INDEX_CHECK 1             // when one of its directories changed
+#define INDEX_UPDATE 2            // -u, compare every file
+int index_query(const char *index, const char *dir, const char *searchstr, int update);
+int index_watch(const char *index, const char *dir);
+
+#endif
@@ -11,10 +11,25 @@ then
     exit 1
 fi
 
-if [ -d $1 ] 
+# the native finder prints the same line, walking the tree in parallel,
+# but matches searchstr as a fixed string, so grep keeps the searchstr
+# with a character that is special in a basic regular expression
+FINDER=$( dirname $0 )/finder
+case "$2" in
+    *[.*[\\^$]*)
+	;;
+    *)
+	if [ -x "$FINDER" ]
+	then
+	    exec "$FINDER" -- "$1" "$2"
+	fi
+	;;
+esac
+
+if [ -d "$1" ] 
 then
-    x=$( ls $1 | wc -l )
-    y=$( grep -rin $2 $1 | wc -l )
+    x=$( ls "$1" | wc -l )
+    y=$( grep -rin -- "$2" "$1" | wc -l )
     echo "The number of files are $x and the number of matching lines are $y"
 else
     echo "$1 is not a directory"
@@ -0,0 +1,1105 @@
+#define _GNU_SOURCE
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/inotify.h>
+#include <fcntl.h>
+#include <dirent.h>   // DT_*
+#include <unistd.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include "finder.h"
+/* findindex.c
+   trigram index of a tree for finder -x
+
+   the index lists every regular file below filesdir with its size, mtime
+   and the trigrams of its content folded to lower case.  a query looks up
+   the trigrams of searchstr and only searches the files holding all of
+   them, so its cost follows the number of candidates and not the size of
+   the tree.  an update walks the tree with stat only and compares it with
+   the file records; when something changed it takes the trigrams of the
+   unchanged files from the postings and reads again just the others.  an
+   index below filesdir leaves itself out.
+
+   a query stats only the directories of the index: a file added, removed
+   or renamed changes the mtime of its directory and brings on an update,
+   a file rewritten in place does not.  finder -x index -w keeps the index
+   current for those as well, -u updates before every query.
+
+   index file, native byte order, written under a temporary name and
+   renamed into place:
+     header
+     files      per file and directory: mtime sec, mtime nsec, size,
+                flags, path length and the path relative to filesdir,
+                sorted by path
+     fileoffs   offset of each file record, by file id
+     postings   per trigram: ids of the files holding it, delta coded, or
+                a bit map by file id for a trigram of at least one file
+                in 8, which takes no more room than one byte per id
+     keys       sorted (trigram, posting count, posting offset)
+*/
+
+#define INDEX_MAGIC "FNDIDX02"
+#define FILE_BINARY 0x1         // binary or unreadable, never matches
+#define FILE_DIR 0x2            // a directory, for its mtime only
+#define NKEYS (1 << 24)         // trigrams of 3 bytes
+#define WATCH_QUIET_MS 500      // wait for the tree to settle before an update
+
+struct index_header {
+  char magic[8];
+  uint64_t nfiles;
+  uint64_t nkeys;
+  uint64_t files_off;
+  uint64_t fileoffs_off;
+  uint64_t post_off;
+  uint64_t keys_off;
+  uint64_t size;
+};
+
+struct index_key {
+  uint32_t key;
+  uint32_t count;
+  uint64_t off;
+};
+
+struct file_record {
+  int64_t mtime_sec;
+  int64_t mtime_nsec;
+  uint64_t size;
+  uint32_t flags;
+  uint32_t pathlen;
+};
+
+struct ifile {
+  char *path;                 // relative to filesdir
+  struct file_record rec;
+  uint32_t ntri;
+  uint32_t *tri;              // sorted trigrams, NULL until read
+  uint32_t filled;            // trigrams of tri taken from the postings so far
+  int fresh;                  // content must be read again
+};
+
+struct filelist {
+  struct ifile *files;
+  size_t count;
+  size_t cap;
+};
+
+/* how walk treats the index file itself when it lies below filesdir */
+struct walk_skip {
+  char *path;                 // relative to filesdir, NULL when outside
+  size_t len;
+  char *dir;                  // its directory relative to filesdir
+  const char *name;           // its last component
+  int wd;                     // inotify watch of that directory, -1 if none
+};
+
+/* per thread state of the trigram extraction */
+struct extract {
+  struct filelist *fl;
+  const char *dir;
+  size_t next;                // next file to read, shared by the threads
+};
+
+static size_t put_varint(unsigned char *p, uint64_t v)
+{
+  size_t n = 0;
+
+  while (v >= 0x80) {
+    p[n++] = v | 0x80;
+    v >>= 7;
+  }
+  p[n++] = v;
+  return n;
+}
+
+/* return -1 past end */
+static int get_varint(const unsigned char **p, const unsigned char *end, uint64_t *v)
+{
+  int shift = 0;
+
+  *v = 0;
+  while (*p < end && shift < 64) {
+    *v |= (uint64_t) (**p & 0x7f) << shift;
+    if (*(*p)++ < 0x80)
+      return 0;
+    shift += 7;
+  }
+  return -1;
+}
+
+static int cmp_path(const void *a, const void *b)
+{
+  return strcmp(((const struct ifile *) a)->path, ((const struct ifile *) b)->path);
+}
+
+static int cmp_u32(const void *a, const void *b)
+{
+  uint32_t x = *(const uint32_t *) a, y = *(const uint32_t *) b;
+
+  return (x > y) - (x < y);
+}
+
+static void free_files(struct filelist *fl)
+{
+  size_t i;
+
+  for (i = 0; i < fl->count; i++) {
+    free(fl->files[i].path);
+    free(fl->files[i].tri);
+  }
+  free(fl->files);
+  memset(fl, 0, sizeof *fl);
+}
+
+static struct ifile *add_file(struct filelist *fl)
+{
+  struct ifile *files;
+
+  if (fl->count == fl->cap) {
+    files = realloc(fl->files, (fl->cap ? fl->cap * 2 : 1024) * sizeof *files);
+    if (files == NULL)
+      return NULL;
+    fl->files = files;
+    fl->cap = fl->cap ? fl->cap * 2 : 1024;
+  }
+  memset(&fl->files[fl->count], 0, sizeof *fl->files);
+  return &fl->files[fl->count++];
+}
+
+/* collect the regular files below dir/rel with their stat, the same files
+   finder searches, but not the index and its temporary file, and the
+   directories with their mtime.  add an inotify watch on every directory
+   when ifd is not -1.  return -1 on error */
+static int walk(const char *dir, const char *rel, struct filelist *fl, int ifd,
+		struct walk_skip *skip)
+{
+  struct linux_dirent64 *d;
+  struct ifile *f;
+  struct stat st;
+  char *path;
+  char *child;
+  char *buf;
+  long n, off;
+  int fd;
+  int wd;
+  int ret = 0;
+
+  if (asprintf(&path, "%s%s%s", dir, *rel ? "/" : "", rel) == -1)
+    return -1;
+  fd = open(path, O_RDONLY | O_DIRECTORY);
+  if (fd == -1) {
+    free(path);
+    return 0; // gone or unreadable, grep skips it as well
+  }
+  // its mtime before the entries are read, a change while they are
+  // read shows on the next query
+  if (fstat(fd, &st) == 0) {
+    f = add_file(fl);
+    if (f == NULL || (f->path = strdup(rel)) == NULL) {
+      free(path);
+      close(fd);
+      return -1;
+    }
+    f->rec.mtime_sec = st.st_mtim.tv_sec;
+    f->rec.mtime_nsec = st.st_mtim.tv_nsec;
+    f->rec.flags = FILE_DIR;
+    f->rec.pathlen = strlen(rel);
+  }
+  if (ifd != -1) {
+    wd = inotify_add_watch(ifd, path, IN_CREATE | IN_DELETE | IN_CLOSE_WRITE | IN_MODIFY
+			   | IN_MOVED_FROM | IN_MOVED_TO | IN_ATTRIB | IN_ONLYDIR);
+    if (skip->path != NULL && strcmp(rel, skip->dir) == 0)
+      skip->wd = wd;
+  }
+  free(path);
+
+  buf = malloc(DIRENT_BUF);
+  while (ret == 0 && buf != NULL && (n = syscall(SYS_getdents64, fd, buf, DIRENT_BUF)) > 0) {
+    for (off = 0; ret == 0 && off < n; off += d->d_reclen) {
+      d = (struct linux_dirent64 *) (buf + off);
+      if (strcmp(d->d_name, ".") == 0 || strcmp(d->d_name, "..") == 0)
+	continue;
+      if (d->d_type != DT_DIR && d->d_type != DT_REG && d->d_type != DT_UNKNOWN)
+	continue;
+      if (fstatat(fd, d->d_name, &st, AT_SYMLINK_NOFOLLOW) == -1)
+	continue;
+      if (!S_ISDIR(st.st_mode) && !S_ISREG(st.st_mode))
+	continue;
+
+      if (asprintf(&child, "%s%s%s", rel, *rel ? "/" : "", d->d_name) == -1) {
+	ret = -1;
+	break;
+      }
+      if (S_ISDIR(st.st_mode)) {
+	ret = walk(dir, child, fl, ifd, skip);
+	free(child);
+	continue;
+      }
+      if (skip->path != NULL && strncmp(child, skip->path, skip->len) == 0
+	  && (child[skip->len] == '\0' || strcmp(child + skip->len, ".tmp") == 0)) {
+	free(child);
+	continue;
+      }
+      f = add_file(fl);
+      if (f == NULL) {
+	free(child);
+	ret = -1;
+	break;
+      }
+      f->path = child;
+      f->rec.mtime_sec = st.st_mtim.tv_sec;
+      f->rec.mtime_nsec = st.st_mtim.tv_nsec;
+      f->rec.size = st.st_size;
+      f->rec.pathlen = strlen(child);
+      f->fresh = 1;
+    }
+  }
+  if (buf == NULL)
+    ret = -1;
+  free(buf);
+  close(fd);
+  return ret;
+}
+
+/* return 0 if map holds an index whose sections lie in order within it */
+static int check_index(const unsigned char *map, size_t size)
+{
+  const struct index_header *h = (const struct index_header *) map;
+
+  if (map == NULL || size < sizeof *h || memcmp(h->magic, INDEX_MAGIC, 8) != 0 || h->size != size)
+    return -1;
+  if (h->files_off < sizeof *h || h->files_off > h->fileoffs_off || h->fileoffs_off > h->post_off
+      || h->post_off > h->keys_off || h->keys_off > size || h->keys_off % 8 != 0)
+    return -1;
+  if (h->nfiles > (h->post_off - h->fileoffs_off) / sizeof(uint64_t)
+      || h->nkeys > (size - h->keys_off) / sizeof(struct index_key))
+    return -1;
+  return 0;
+}
+
+/* whether the posting list of a trigram held by count of nfiles files is
+   a bit map */
+static int dense(uint64_t count, uint64_t nfiles)
+{
+  return count >= (nfiles + 7) / 8;
+}
+
+/* the record of file id into rec, return its path, rec->pathlen bytes, or
+   NULL if it lies outside the file records */
+static const char *get_record(const unsigned char *map, uint64_t id, struct file_record *rec)
+{
+  const struct index_header *h = (const struct index_header *) map;
+  uint64_t off;
+
+  if (id >= h->nfiles)
+    return NULL;
+  memcpy(&off, map + h->fileoffs_off + id * sizeof off, sizeof off);
+  if (off < h->files_off || off > h->fileoffs_off || h->fileoffs_off - off < sizeof *rec)
+    return NULL;
+  memcpy(rec, map + off, sizeof *rec);
+  if (h->fileoffs_off - off - sizeof *rec < rec->pathlen)
+    return NULL;
+  return (const char *) map + off + sizeof *rec;
+}
+
+/* read the file records of a checked index back, without their trigrams
+   return -1 if they are not valid */
+static int load_files(const unsigned char *map, struct filelist *fl)
+{
+  const struct index_header *h = (const struct index_header *) map;
+  const unsigned char *p, *end = map + h->fileoffs_off;
+  struct ifile *f;
+  uint64_t i;
+
+  p = map + h->files_off;
+  for (i = 0; i < h->nfiles; i++) {
+    f = add_file(fl);
+    if (f == NULL || (size_t) (end - p) < sizeof f->rec)
+      return -1;
+    memcpy(&f->rec, p, sizeof f->rec);
+    p += sizeof f->rec;
+    if ((size_t) (end - p) < f->rec.pathlen || (f->path = strndup((const char *) p, f->rec.pathlen)) == NULL)
+      return -1;
+    p += f->rec.pathlen;
+  }
+  return 0;
+}
+
+static unsigned char *map_index(const char *index, size_t *size)
+{
+  struct stat st;
+  unsigned char *map;
+  int fd;
+
+  fd = open(index, O_RDONLY);
+  if (fd == -1)
+    return NULL;
+  if (fstat(fd, &st) == -1 || st.st_size == 0) {
+    close(fd);
+    return NULL;
+  }
+  map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED)
+    return NULL;
+  *size = st.st_size;
+  return map;
+}
+
+/* decode one posting list, return the number of ids */
+static size_t read_postings(const unsigned char *map, const struct index_key *k, uint32_t *ids)
+{
+  const struct index_header *h = (const struct index_header *) map;
+  const unsigned char *p = map + k->off;
+  uint64_t v, id = 0;
+  size_t n = 0;
+  unsigned b;
+
+  if (k->off < h->post_off || k->off > h->keys_off || k->count > h->nfiles)
+    return 0;
+  if (dense(k->count, h->nfiles)) {
+    if (h->keys_off - k->off < (h->nfiles + 7) / 8)
+      return 0;
+    for (id = 0; id < h->nfiles && n < k->count; id += 8) {
+      for (b = p[id / 8]; b && n < k->count; b &= b - 1)
+	ids[n++] = id + __builtin_ctz(b);
+    }
+    return n;
+  }
+  for (n = 0; n < k->count && get_varint(&p, map + h->keys_off, &v) == 0; n++) {
+    id += v;
+    ids[n] = id;
+  }
+  return n;
+}
+
+/* the trigrams of the files load_files read, from the postings: every
+   posting list adds its trigram to the files it holds, in key order so
+   that every file gets its trigrams sorted.  return -1 if the postings
+   are not valid */
+static int load_trigrams(const unsigned char *map, struct filelist *fl)
+{
+  const struct index_header *h = (const struct index_header *) map;
+  const struct index_key *keys = (const struct index_key *) (map + h->keys_off);
+  struct ifile *f;
+  uint32_t *ids;
+  uint64_t i;
+  size_t j, n;
+  int pass;
+  int ret = 0;
+
+  ids = malloc((h->nfiles ? h->nfiles : 1) * sizeof *ids);
+  if (ids == NULL)
+    return -1;
+  // count the trigrams of every file, then fill them in
+  for (pass = 0; pass < 2 && ret == 0; pass++) {
+    for (i = 0; i < h->nkeys && ret == 0; i++) {
+      n = read_postings(map, &keys[i], ids);
+      if (n != keys[i].count)
+	ret = -1;
+      for (j = 0; j < n && ret == 0; j++) {
+	if (ids[j] >= fl->count) {
+	  ret = -1;
+	  break;
+	}
+	f = &fl->files[ids[j]];
+	if (pass == 0)
+	  f->ntri++;
+	else
+	  f->tri[f->filled++] = keys[i].key;
+      }
+    }
+    for (i = 0; pass == 0 && ret == 0 && i < fl->count; i++) {
+      fl->files[i].tri = malloc((fl->files[i].ntri ? fl->files[i].ntri : 1) * sizeof *fl->files[i].tri);
+      if (fl->files[i].tri == NULL)
+	ret = -1;
+    }
+  }
+  free(ids);
+  return ret;
+}
+
+/* trigrams of one file into f->tri, seen is a zeroed NKEYS bit map and
+   left zeroed, buf holds READ_MAX bytes */
+static void read_trigrams(const char *dir, struct ifile *f, uint64_t *seen, unsigned char *buf)
+{
+  unsigned char *data = buf;
+  char *path;
+  uint32_t *keys = NULL;
+  uint32_t key;
+  size_t len = 0;
+  size_t i, n = 0;
+  ssize_t r;
+  int fd = -1;
+
+  f->rec.flags = FILE_BINARY;
+  f->ntri = 0;
+  free(f->tri);
+  f->tri = NULL;
+
+  if (asprintf(&path, "%s/%s", dir, f->path) != -1) {
+    fd = open(path, O_RDONLY | O_NOFOLLOW);
+    free(path);
+  }
+  if (fd == -1)
+    return;
+
+  // like search_file: small files are read, big ones mapped
+  if (f->rec.size <= READ_MAX) {
+    while (len < READ_MAX && (r = read(fd, buf + len, READ_MAX - len)) > 0)
+      len += r;
+  }
+  else {
+    data = mmap(NULL, f->rec.size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (data == MAP_FAILED)
+      data = NULL;
+    else
+      len = f->rec.size;
+  }
+  close(fd);
+  if (data == NULL)
+    return;
+
+  if (memchr(data, '\0', len < BINARY_PROBE ? len : BINARY_PROBE) == NULL
+      && (keys = malloc((len > 2 ? len - 2 : 1) * sizeof *keys)) != NULL) {
+    f->rec.flags = 0;
+    for (i = 0; i + 2 < len; i++) {
+      key = fold[data[i]] << 16 | fold[data[i + 1]] << 8 | fold[data[i + 2]];
+      if (seen[key >> 6] & (1ULL << (key & 63)))
+	continue;
+      seen[key >> 6] |= 1ULL << (key & 63);
+      keys[n++] = key;
+    }
+    for (i = 0; i < n; i++)
+      seen[keys[i] >> 6] = 0;
+    qsort(keys, n, sizeof *keys, cmp_u32);
+    f->ntri = n;
+    f->tri = realloc(keys, (n ? n : 1) * sizeof *keys);
+    if (f->tri == NULL)
+      f->tri = keys;
+  }
+  if (data != buf)
+    munmap(data, len);
+}
+
+static void *extract_main(void *arg)
+{
+  struct extract *x = arg;
+  uint64_t *seen;
+  unsigned char *buf;
+  size_t i;
+
+  seen = calloc(NKEYS / 64, sizeof *seen);
+  buf = malloc(READ_MAX);
+  while (seen != NULL && buf != NULL
+	 && (i = __atomic_fetch_add(&x->next, 1, __ATOMIC_RELAXED)) < x->fl->count) {
+    if (x->fl->files[i].fresh)
+      read_trigrams(x->dir, &x->fl->files[i], seen, buf);
+  }
+  free(seen);
+  free(buf);
+  return NULL;
+}
+
+/* read the new and changed files with one thread per cpu */
+static void extract_all(const char *dir, struct filelist *fl)
+{
+  pthread_t threads[MAX_THREADS];
+  struct extract x;
+  long nthreads;
+  int started;
+
+  x.fl = fl;
+  x.dir = dir;
+  x.next = 0;
+  nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+  if (nthreads > MAX_THREADS)
+    nthreads = MAX_THREADS;
+  for (started = 1; started < nthreads; started++) {
+    if (pthread_create(&threads[started], NULL, extract_main, &x) != 0)
+      break;
+  }
+  extract_main(&x);
+  while (--started > 0)
+    pthread_join(threads[started], NULL);
+}
+
+/* write bytes to out, keeping count of the offset */
+static int put(FILE *out, const void *p, size_t len, uint64_t *pos)
+{
+  *pos += len;
+  return fwrite(p, 1, len, out) == len ? 0 : -1;
+}
+
+/* the position of key among the trigrams present in bits, rank holds the
+   present trigrams before each word of bits */
+static uint32_t key_rank(const uint64_t *bits, const uint32_t *rank, uint32_t key)
+{
+  return rank[key >> 6] + __builtin_popcountll(bits[key >> 6] & ((1ULL << (key & 63)) - 1));
+}
+
+/* write the index of fl, then give the record of the directory holding
+   the index, when it lies below dir, the mtime that directory got from
+   the rename, in fl as well, so that a query does not take it for a
+   change */
+static int write_index(const char *index, const char *dir, struct filelist *fl,
+		       const struct walk_skip *skip)
+{
+  struct index_header h;
+  struct index_key ik;
+  struct index_key *keys = NULL;
+  unsigned char vbuf[10];
+  uint64_t *bits;
+  uint32_t *rank = NULL;
+  uint32_t *start = NULL;
+  uint32_t *ids = NULL;
+  unsigned char *bitmap = NULL;
+  int64_t mtime[2];
+  uint64_t pos = 0;
+  uint64_t total = 0;
+  uint64_t skip_off = 0;
+  size_t skip_i = 0;
+  uint64_t off, prev, w;
+  size_t i, k, first;
+  struct stat st;
+  char *tmp = NULL;
+  char *path;
+  FILE *out = NULL;
+  int ret = 0;
+  int fd;
+
+  // the trigrams present as a bit map, each numbered by its rank among
+  // them, so the counts below need one slot per present trigram only
+  memset(&h, 0, sizeof h);
+  bits = calloc(NKEYS / 64, sizeof *bits);
+  rank = malloc(NKEYS / 64 * sizeof *rank);
+  if (bits == NULL || rank == NULL)
+    goto fail;
+  for (i = 0; i < fl->count; i++) {
+    for (k = 0; k < fl->files[i].ntri; k++)
+      bits[fl->files[i].tri[k] >> 6] |= 1ULL << (fl->files[i].tri[k] & 63);
+    total += fl->files[i].ntri;
+  }
+  for (k = 0; k < NKEYS / 64; k++) {
+    rank[k] = h.nkeys;
+    h.nkeys += __builtin_popcountll(bits[k]);
+  }
+
+  // file ids holding each trigram, counted then filled in place
+  start = calloc(h.nkeys + 1, sizeof *start);
+  ids = malloc((total ? total : 1) * sizeof *ids);
+  keys = malloc((h.nkeys ? h.nkeys : 1) * sizeof *keys);
+  if (start == NULL || ids == NULL || keys == NULL)
+    goto fail;
+  for (i = 0; i < fl->count; i++)
+    for (k = 0; k < fl->files[i].ntri; k++)
+      start[key_rank(bits, rank, fl->files[i].tri[k])]++;
+  for (k = 0, off = 0; k < h.nkeys; k++) {
+    prev = start[k];
+    start[k] = off;
+    off += prev;
+  }
+  // in file order, so every list comes out sorted; start[k] ends as the
+  // start of k + 1
+  for (i = 0; i < fl->count; i++)
+    for (k = 0; k < fl->files[i].ntri; k++)
+      ids[start[key_rank(bits, rank, fl->files[i].tri[k])]++] = i;
+  for (k = 0, i = 0; k < NKEYS / 64; k++)
+    for (w = bits[k]; w; w &= w - 1)
+      keys[i++].key = k << 6 | __builtin_ctzll(w);
+
+  if (asprintf(&tmp, "%s.tmp", index) == -1 || (out = fopen(tmp, "w")) == NULL)
+    goto fail;
+  setvbuf(out, NULL, _IOFBF, 1 << 20);
+
+  memcpy(h.magic, INDEX_MAGIC, 8);
+  h.nfiles = fl->count;
+  ret |= put(out, &h, sizeof h, &pos);
+
+  h.files_off = pos;
+  for (i = 0; i < fl->count; i++) {
+    if (skip->path != NULL && (fl->files[i].rec.flags & FILE_DIR)
+	&& strcmp(fl->files[i].path, skip->dir) == 0) {
+      skip_off = pos;
+      skip_i = i;
+    }
+    ret |= put(out, &fl->files[i].rec, sizeof fl->files[i].rec, &pos);
+    ret |= put(out, fl->files[i].path, fl->files[i].rec.pathlen, &pos);
+  }
+
+  h.fileoffs_off = pos;
+  for (i = 0, off = h.files_off; i < fl->count; i++) {
+    ret |= put(out, &off, sizeof off, &pos);
+    off += sizeof fl->files[i].rec + fl->files[i].rec.pathlen;
+  }
+
+  h.post_off = pos;
+  bitmap = malloc((fl->count + 7) / 8 + 1);
+  if (bitmap == NULL)
+    goto fail;
+  for (k = 0, first = 0; k < h.nkeys; first = start[k], k++) {
+    keys[k].count = start[k] - first;
+    keys[k].off = pos;
+    if (dense(keys[k].count, fl->count)) {
+      memset(bitmap, 0, (fl->count + 7) / 8);
+      for (off = first; off < start[k]; off++)
+	bitmap[ids[off] / 8] |= 1 << (ids[off] % 8);
+      ret |= put(out, bitmap, (fl->count + 7) / 8, &pos);
+      continue;
+    }
+    for (off = first, prev = 0; off < start[k]; prev = ids[off], off++)
+      ret |= put(out, vbuf, put_varint(vbuf, ids[off] - prev), &pos);
+  }
+
+  // the keys are read in place from the map, align them
+  memset(vbuf, 0, sizeof vbuf);
+  ret |= put(out, vbuf, -pos & 7, &pos);
+  h.keys_off = pos;
+  for (i = 0; i < h.nkeys; i++) {
+    ik = keys[i];
+    ret |= put(out, &ik, sizeof ik, &pos);
+  }
+
+  h.size = pos;
+  if (fseek(out, 0, SEEK_SET) == -1)
+    ret = -1;
+  ret |= put(out, &h, sizeof h, &pos);
+  if (fclose(out) != 0)
+    ret = -1;
+  if (ret == 0 && rename(tmp, index) == -1)
+    ret = -1;
+  if (ret != 0) {
+    perror("can not write index");
+    unlink(tmp);
+  }
+  // a change in between is missed until the next one in that directory
+  if (ret == 0 && skip_off != 0
+      && asprintf(&path, "%s%s%s", dir, *skip->dir ? "/" : "", skip->dir) != -1) {
+    if (stat(path, &st) == 0 && (fd = open(index, O_WRONLY)) != -1) {
+      mtime[0] = fl->files[skip_i].rec.mtime_sec = st.st_mtim.tv_sec;
+      mtime[1] = fl->files[skip_i].rec.mtime_nsec = st.st_mtim.tv_nsec;
+      if (pwrite(fd, mtime, sizeof mtime, skip_off + offsetof(struct file_record, mtime_sec)) != sizeof mtime)
+	perror("can not write index");
+      close(fd);
+    }
+    free(path);
+  }
+  goto done;
+
+ fail:
+  perror("can not write index");
+  ret = -1;
+ done:
+  free(tmp);
+  free(bitmap);
+  free(bits);
+  free(rank);
+  free(start);
+  free(ids);
+  free(keys);
+  return ret;
+}
+
+/* find out whether index lies below dir, where walk has to leave it out
+   return -1 on error */
+static int skip_init(struct walk_skip *skip, const char *index, const char *dir)
+{
+  char *idir, *rdir, *ridir;
+  char *slash;
+  char *rel;
+  size_t n;
+  int ret = 0;
+
+  memset(skip, 0, sizeof *skip);
+  skip->wd = -1;
+  slash = strrchr(index, '/');
+  skip->name = slash ? slash + 1 : index;
+  if (slash == NULL)
+    idir = strdup(".");
+  else if (slash == index)
+    idir = strdup("/");
+  else
+    idir = strndup(index, slash - index);
+  if (idir == NULL)
+    return -1;
+  rdir = realpath(dir, NULL);
+  ridir = realpath(idir, NULL);
+  if (rdir != NULL && ridir != NULL) {
+    n = strcmp(rdir, "/") == 0 ? 0 : strlen(rdir);
+    if (strncmp(ridir, rdir, n) == 0 && (ridir[n] == '\0' || ridir[n] == '/')) {
+      rel = ridir + n + (ridir[n] == '/');
+      skip->dir = strdup(rel);
+      if (skip->dir == NULL
+	  || asprintf(&skip->path, "%s%s%s", rel, *rel ? "/" : "", skip->name) == -1) {
+	skip->path = NULL;
+	ret = -1;
+      }
+      else
+	skip->len = strlen(skip->path);
+    }
+  }
+  free(idir);
+  free(rdir);
+  free(ridir);
+  return ret;
+}
+
+static void skip_free(struct walk_skip *skip)
+{
+  free(skip->path);
+  free(skip->dir);
+  skip->path = skip->dir = NULL;
+}
+
+/* pair the files of cur and old, both sorted by path, and count the ones
+   with the same size and mtime.  move their trigrams to cur when take is
+   set */
+static size_t match_files(struct filelist *cur, struct filelist *old, int take)
+{
+  size_t i, j;
+  size_t kept = 0;
+  int cmp;
+
+  for (i = 0, j = 0; i < cur->count && j < old->count; ) {
+    cmp = strcmp(cur->files[i].path, old->files[j].path);
+    if (cmp > 0) {
+      j++;
+      continue;
+    }
+    if (cmp == 0 && cur->files[i].rec.size == old->files[j].rec.size
+	&& cur->files[i].rec.mtime_sec == old->files[j].rec.mtime_sec
+	&& cur->files[i].rec.mtime_nsec == old->files[j].rec.mtime_nsec) {
+      if (take) {
+	cur->files[i].rec.flags = old->files[j].rec.flags;
+	cur->files[i].ntri = old->files[j].ntri;
+	cur->files[i].tri = old->files[j].tri;
+	old->files[j].tri = NULL;
+	cur->files[i].fresh = 0;
+      }
+      kept++;
+    }
+    i++;
+    if (cmp == 0)
+      j++;
+  }
+  return kept;
+}
+
+/* bring index up to date with dir, watching its directories on ifd
+   when that is not -1.  keep, when not NULL, holds the files of the last
+   update with their trigrams, used in place of the index, and gets those
+   of this one.  return -1 on error */
+static int index_update_watch(const char *index, const char *dir, int ifd,
+			      struct walk_skip *skip, struct filelist *keep)
+{
+  struct filelist cur, old;
+  unsigned char *map = NULL;
+  size_t size;
+  int kept = 0;
+  int ret = 0;
+
+  fold_init();
+  memset(&cur, 0, sizeof cur);
+  memset(&old, 0, sizeof old);
+  if (walk(dir, "", &cur, ifd, skip) == -1) {
+    perror("can not walk directory");
+    free_files(&cur);
+    return -1;
+  }
+  qsort(cur.files, cur.count, sizeof *cur.files, cmp_path);
+
+  // compare the file records first, the trigrams are only decoded when
+  // something was added, changed or removed
+  if (keep != NULL && keep->files != NULL) {
+    old = *keep;
+    memset(keep, 0, sizeof *keep);
+    kept = 1;
+  }
+  else {
+    map = map_index(index, &size);
+    if (map != NULL && (check_index(map, size) == -1 || load_files(map, &old) == -1)) {
+      free_files(&old); // not an index or damaged, build anew
+      munmap(map, size);
+      map = NULL;
+    }
+  }
+  if ((map != NULL || kept) && match_files(&cur, &old, 0) == cur.count && cur.count == old.count) {
+    if (map != NULL)
+      munmap(map, size);
+    if (keep != NULL && kept)
+      *keep = old;
+    else
+      free_files(&old);
+    free_files(&cur);
+    return 0;
+  }
+
+  if (map != NULL) {
+    if (load_trigrams(map, &old) == 0)
+      match_files(&cur, &old, 1);
+    munmap(map, size);
+  }
+  else if (kept)
+    match_files(&cur, &old, 1);
+  extract_all(dir, &cur);
+  ret = write_index(index, dir, &cur, skip);
+  free_files(&old);
+  if (keep != NULL && ret == 0)
+    *keep = cur;
+  else
+    free_files(&cur);
+  return ret;
+}
+
+/* return 1 if a directory of the index is gone or has another mtime, a
+   file was added, removed or renamed there, 0 if none has */
+static int index_stale(const unsigned char *map, const char *dir)
+{
+  const struct index_header *h = (const struct index_header *) map;
+  struct file_record rec;
+  struct stat st;
+  const char *name;
+  char *path;
+  uint64_t i;
+  int ret;
+
+  for (i = 0; i < h->nfiles; i++) {
+    name = get_record(map, i, &rec);
+    if (name == NULL)
+      return 1;
+    if (!(rec.flags & FILE_DIR))
+      continue;
+    if (asprintf(&path, "%s%s%.*s", dir, rec.pathlen ? "/" : "", (int) rec.pathlen, name) == -1)
+      return 1;
+    ret = lstat(path, &st);
+    free(path);
+    if (ret == -1 || !S_ISDIR(st.st_mode) || st.st_mtim.tv_sec != rec.mtime_sec
+	|| st.st_mtim.tv_nsec != rec.mtime_nsec)
+      return 1;
+  }
+  return 0;
+}
+
+static const struct index_key *find_key(const struct index_key *keys, uint64_t nkeys, uint32_t key)
+{
+  uint64_t lo = 0, hi = nkeys, mid;
+
+  while (lo < hi) {
+    mid = (lo + hi) / 2;
+    if (keys[mid].key < key)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  return lo < nkeys && keys[lo].key == key ? &keys[lo] : NULL;
+}
+
+int index_query(const char *index, const char *dir, const char *searchstr, int update)
+{
+  const struct index_header *h;
+  const struct index_key *keys;
+  const struct index_key *k;
+  const struct index_key *best = NULL;
+  struct walk_skip skip;
+  struct file_record rec;
+  struct search s;
+  unsigned char *map;
+  uint32_t *cand = NULL;
+  uint32_t *other = NULL;
+  size_t size;
+  size_t ncand = 0;
+  size_t i, j, n, m;
+  unsigned long matches;
+  uint32_t key;
+  const char *name;
+  char *path;
+  int ret = 1;
+
+  map = NULL;
+  if (update == INDEX_CHECK) {
+    map = map_index(index, &size);
+    if (map != NULL && (check_index(map, size) == -1 || index_stale(map, dir))) {
+      munmap(map, size);
+      map = NULL;
+    }
+  }
+  if (update == INDEX_UPDATE || (update == INDEX_CHECK && map == NULL)) {
+    if (skip_init(&skip, index, dir) == -1) {
+      perror("malloc");
+      return 1;
+    }
+    ret = index_update_watch(index, dir, -1, &skip, NULL);
+    skip_free(&skip);
+    if (ret == -1)
+      return 1;
+    ret = 1;
+  }
+  if (map == NULL)
+    map = map_index(index, &size);
+  if (check_index(map, size) == -1) {
+    printf("%s is not a finder index\n", index);
+    if (map != NULL)
+      munmap(map, size);
+    return 1;
+  }
+  h = (const struct index_header *) map;
+  keys = (const struct index_key *) (map + h->keys_off);
+  if (search_init(&s, searchstr) == -1) {
+    munmap(map, size);
+    return 1;
+  }
+
+  // files holding every trigram of searchstr, start from the rarest one
+  if (s.patlen >= 3) {
+    for (i = 0; i + 2 < s.patlen; i++) {
+      key = s.pat[i] << 16 | s.pat[i + 1] << 8 | s.pat[i + 2];
+      k = find_key(keys, h->nkeys, key);
+      if (k == NULL) {
+	best = NULL;
+	break;
+      }
+      if (best == NULL || k->count < best->count)
+	best = k;
+    }
+    if (best != NULL) {
+      cand = malloc((h->nfiles ? h->nfiles : 1) * sizeof *cand);
+      other = malloc((h->nfiles ? h->nfiles : 1) * sizeof *other);
+      if (cand == NULL || other == NULL) {
+	perror("malloc");
+	goto out;
+      }
+      ncand = read_postings(map, best, cand);
+      for (i = 0; ncand > 0 && i + 2 < s.patlen; i++) {
+	key = s.pat[i] << 16 | s.pat[i + 1] << 8 | s.pat[i + 2];
+	k = find_key(keys, h->nkeys, key);
+	if (k == best)
+	  continue;
+	n = read_postings(map, k, other);
+	for (j = 0, m = 0, key = 0; j < ncand; j++) {
+	  while (m < n && other[m] < cand[j])
+	    m++;
+	  if (m < n && other[m] == cand[j])
+	    cand[key++] = cand[j];
+	}
+	ncand = key;
+      }
+    }
+  }
+  else {
+    // too short for a trigram, every text file is a candidate
+    cand = malloc((h->nfiles ? h->nfiles : 1) * sizeof *cand);
+    if (cand == NULL) {
+      perror("malloc");
+      goto out;
+    }
+    for (i = 0; i < h->nfiles; i++) {
+      if (get_record(map, i, &rec) != NULL && !(rec.flags & (FILE_BINARY | FILE_DIR)))
+	cand[ncand++] = i;
+    }
+  }
+
+  // the candidates are searched like any file, so the counts match grep
+  for (i = 0; i < ncand; i++) {
+    name = get_record(map, cand[i], &rec);
+    if (name == NULL)
+      continue;
+    if (asprintf(&path, "%s/%.*s", dir, (int) rec.pathlen, name) == -1) {
+      perror("malloc");
+      goto out;
+    }
+    if (search_add(&s, path, 0) == -1) {
+      perror("malloc");
+      free(path);
+      goto out;
+    }
+  }
+  matches = search_run(&s);
+
+  printf("The number of files are %ld and the number of matching lines are %lu\n",
+	 count_entries(dir), matches);
+  ret = 0;
+
+ out:
+  free(cand);
+  free(other);
+  search_free(&s);
+  munmap(map, size);
+  return ret;
+}
+
+/* drain the events of ifd, return 1 if one of them is not about the
+   index itself */
+static int read_events(int ifd, const struct walk_skip *skip)
+{
+  char buf[64 * 1024] __attribute__ ((aligned(__alignof__(struct inotify_event))));
+  const struct inotify_event *ev;
+  size_t len = strlen(skip->name);
+  ssize_t n;
+  char *p;
+  int changed = 0;
+
+  while ((n = read(ifd, buf, sizeof buf)) > 0) {
+    for (p = buf; p < buf + n; p += sizeof *ev + ev->len) {
+      ev = (const struct inotify_event *) p;
+      if (skip->path != NULL && ev->wd == skip->wd && ev->len > 0
+	  && strncmp(ev->name, skip->name, len) == 0
+	  && (ev->name[len] == '\0' || strcmp(ev->name + len, ".tmp") == 0))
+	continue;
+      changed = 1;
+    }
+  }
+  return changed;
+}
+
+int index_watch(const char *index, const char *dir)
+{
+  struct walk_skip skip;
+  struct filelist keep;
+  struct pollfd pfd;
+  int ifd;
+
+  ifd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+  if (ifd == -1) {
+    perror("inotify_init1");
+    return 1;
+  }
+  if (skip_init(&skip, index, dir) == -1) {
+    perror("malloc");
+    close(ifd);
+    return 1;
+  }
+  pfd.fd = ifd;
+  pfd.events = POLLIN;
+  memset(&keep, 0, sizeof keep);
+
+  for (;;) {
+    // the walk also watches directories created since the last one, the
+    // trigrams of the unchanged files stay in keep from one to the next
+    if (index_update_watch(index, dir, ifd, &skip, &keep) == -1)
+      break;
+
+    // wait for a change other than the index rewrite, then for the tree
+    // to be quiet for a moment
+    do {
+      if (poll(&pfd, 1, -1) == -1 && errno != EINTR) {
+	perror("poll");
+	goto out;
+      }
+    } while (!read_events(ifd, &skip));
+    while (poll(&pfd, 1, WATCH_QUIET_MS) > 0)
+      read_events(ifd, &skip);
+  }
+ out:
+  free_files(&keep);
+  skip_free(&skip);
+  close(ifd);
+  return 1;
+}
@@ -0,0 +1,48 @@
+#!/bin/sh
+# Tests for the writer utility beyond what finder-test.sh covers
+# usage: writer-test.sh [writer]
+
+set -u
+
+WRITER=${1:-$(dirname $0)/writer}
+TESTDIR=$(mktemp -d ${TMPDIR:-/tmp}/writer-test.XXXXXX)
+FAILED=0
+
+trap "rm -rf ${TESTDIR}" EXIT
+
+# expect name expected actual
+expect()
+{
+	if [ "$2" = "$3" ]
+	then
+		echo "ok: $1"
+	else
+		echo "failed: $1: expected '$2' but found '$3'"
+		FAILED=1
+	fi
+}
+
+# writefile writestr
+"${WRITER}" "${TESTDIR}/single.txt" AELD_IS_FUN
+expect "writer file str" AELD_IS_FUN "$(cat ${TESTDIR}/single.txt)"
+
+# a manifest of two records
+printf '%s\0%s\0%s\0%s\0' "${TESTDIR}/one.txt" one "${TESTDIR}/two.txt" two | "${WRITER}" -b -
+expect "writer -b, first record" one "$(cat ${TESTDIR}/one.txt)"
+expect "writer -b, second record" two "$(cat ${TESTDIR}/two.txt)"
+
+# a last record with no writestr is rejected, not written as empty
+echo keep > "${TESTDIR}/keep.txt"
+printf '%s\0%s\0%s\0' "${TESTDIR}/three.txt" three "${TESTDIR}/keep.txt" | "${WRITER}" -b -
+expect "writer -b, record without writestr fails" 1 $?
+expect "writer -b, record without writestr leaves the file" keep "$(cat ${TESTDIR}/keep.txt)"
+
+# a piped stream written with O_DIRECT is cut back to its real size
+if printf abc | "${WRITER}" -i - -p 8192 -D "${TESTDIR}/direct.txt" 2> /dev/null
+then
+	expect "writer -D, piped stream size" 3 $(wc -c < ${TESTDIR}/direct.txt)
+else
+	echo "skipped: writer -D, no O_DIRECT on the file system of ${TESTDIR}"
+fi
+
+exit ${FAILED}
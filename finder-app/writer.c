@@ -1,3 +1,4 @@
+#define _GNU_SOURCE    // copy_file_range, splice, fallocate, O_DIRECT
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <fcntl.h>
@@ -5,38 +6,465 @@
 #include <syslog.h>
 #include <string.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <pthread.h>
 /* write.c
    parameter1 writefile
    parameter2 writestr
-   
+
    return 1 if missing arguments
    return 1 and print error message if fail to create file
+
+   batch mode: writer -b manifest [-j threads]
+   manifest holds (writefile, writestr) records, each field ended by a
+   nul byte as in printf '%s\0%s\0' file str, "-" reads it from stdin.
+   the files are written by a pool of threads, one process for all
+
+   stream mode: writer -i source [-p size] [-D] writefile
+   the content comes from the file source, "-" for stdin, instead of
+   writestr.  a regular source is copied in the kernel with
+   copy_file_range, a pipe with splice.  the file is preallocated to the
+   source size, or to -p size when that is unknown.  -D writes through
+   O_DIRECT from aligned buffers and skips the page cache
 */
 
+#define MAX_THREADS 64
+#define COPY_CHUNK (1024 * 1024)    // bytes per read/write, splice or O_DIRECT write
+#define DIRECT_ALIGN 4096           // O_DIRECT buffer, offset and size alignment
+
+/* the records of a manifest, fields point into buf */
+struct batch {
+  char *buf;
+  const char **files;
+  const char **strs;
+  size_t count;
+  size_t next;     // next record to write, taken atomically by the workers
+  size_t failed;
+};
+
+/* write all of buf, going on after partial writes, return -1 on error */
+int write_full(int fd, const char *buf, size_t len)
+{
+  ssize_t n;
+
+  while (len > 0) {
+    n = write(fd, buf, len);
+    if (n == -1) {
+      if (errno == EINTR)
+	continue;
+      return -1;
+    }
+    buf += n;
+    len -= n;
+  }
+  return 0;
+}
+
 int writer(const char *writefile, const char *writestr)
 {
   int fd;
+  int ret = 0;
   fd = open(writefile, O_WRONLY |O_TRUNC | O_CREAT, 0644);
   if (fd == -1) {
     perror("can not open file");
     return 1;
   }
 
-  write(fd, writestr, strlen(writestr));
-  
+  if (write_full(fd, writestr, strlen(writestr)) == -1) {
+    perror("can not write file");
+    ret = 1;
+  }
+
   //syslog(LOG_USER | LOG_DEBUG, "Writing %s to %s", "writestr", "writefile");
-  close(fd);
+  if (close(fd) == -1 && ret == 0) {
+    perror("can not write file");
+    ret = 1;
+  }
+  return ret;
+}
+
+/* copy in to out with plain reads and writes, return -1 on error */
+int copy_rw(int in, int out)
+{
+  char *buf;
+  ssize_t n;
+  int ret = 0;
+
+  buf = malloc(COPY_CHUNK);
+  if (buf == NULL)
+    return -1;
+  while ((n = read(in, buf, COPY_CHUNK)) != 0) {
+    if (n == -1) {
+      if (errno == EINTR)
+	continue;
+      ret = -1;
+      break;
+    }
+    if (write_full(out, buf, n) == -1) {
+      ret = -1;
+      break;
+    }
+  }
+  free(buf);
+  return ret;
+}
+
+/* copy in to out inside the kernel: copy_file_range from a regular file,
+   splice from a pipe.  return -1 on error, 1 if neither works for this
+   pair of files and nothing was copied yet */
+int copy_offload(int in, int out, const struct stat *st)
+{
+  ssize_t n;
+  size_t copied = 0;
+
+  for (;;) {
+    if (S_ISREG(st->st_mode))
+      n = copy_file_range(in, NULL, out, NULL, COPY_CHUNK * 64, 0);
+    else if (S_ISFIFO(st->st_mode))
+      n = splice(in, NULL, out, NULL, COPY_CHUNK, SPLICE_F_MORE);
+    else
+      return 1;
+
+    if (n == 0)
+      return 0;
+    if (n == -1) {
+      if (errno == EINTR)
+	continue;
+      // not supported between these file systems or file types
+      if (copied == 0 && (errno == EXDEV || errno == EINVAL || errno == ENOSYS
+			  || errno == EOPNOTSUPP || errno == EBADF))
+	return 1;
+      return -1;
+    }
+    copied += n;
+  }
+}
+
+/* copy in to out through aligned buffers, out is open with O_DIRECT.
+   the last block is written padded, then cut back to the real size
+   return -1 on error */
+int copy_direct(int in, int out)
+{
+  char *buf;
+  size_t len;
+  size_t padded;
+  off_t total = 0;
+  ssize_t n;
+  int ret = 0;
+
+  if (posix_memalign((void **) &buf, DIRECT_ALIGN, COPY_CHUNK) != 0)
+    return -1;
+  for (;;) {
+    // fill the whole buffer, O_DIRECT writes must stay aligned
+    for (len = 0; len < COPY_CHUNK; len += n) {
+      n = read(in, buf + len, COPY_CHUNK - len);
+      if (n == -1 && errno == EINTR) {
+	n = 0;
+	continue;
+      }
+      if (n <= 0)
+	break;
+    }
+    if (n == -1) {
+      ret = -1;
+      break;
+    }
+    if (len == 0)
+      break;
+
+    padded = (len + DIRECT_ALIGN - 1) & ~((size_t) DIRECT_ALIGN - 1);
+    memset(buf + len, 0, padded - len);
+    if (write_full(out, buf, padded) == -1) {
+      ret = -1;
+      break;
+    }
+    total += len;
+    if (len < COPY_CHUNK)
+      break; // end of input
+  }
+  if (ret == 0 && ftruncate(out, total) == -1)
+    ret = -1;
+  free(buf);
+  return ret;
+}
+
+/* write the content of source ("-" for stdin) to writefile.
+   prealloc is the expected size when source is not a regular file */
+int writer_stream(const char *writefile, const char *source, off_t prealloc, int direct)
+{
+  struct stat st;
+  int in = STDIN_FILENO;
+  int fd;
+  int res;
+  int ret = 0;
+
+  if (strcmp(source, "-") != 0) {
+    in = open(source, O_RDONLY);
+    if (in == -1) {
+      perror("can not open source");
+      return 1;
+    }
+  }
+  if (fstat(in, &st) == -1) {
+    perror("can not stat source");
+    if (in != STDIN_FILENO)
+      close(in);
+    return 1;
+  }
+  if (S_ISREG(st.st_mode))
+    prealloc = st.st_size - lseek(in, 0, SEEK_CUR);
+
+  fd = open(writefile, O_WRONLY | O_TRUNC | O_CREAT | (direct ? O_DIRECT : 0), 0644);
+  if (fd == -1) {
+    perror("can not open file");
+    if (in != STDIN_FILENO)
+      close(in);
+    return 1;
+  }
+
+  // reserve the blocks up front, the file system can lay them out at once
+  if (prealloc > 0 && fallocate(fd, 0, 0, prealloc) == -1 && errno != EOPNOTSUPP) {
+    perror("can not preallocate file");
+    ret = 1;
+  }
+
+  if (ret == 0) {
+    if (direct) {
+      res = copy_direct(in, fd);
+    }
+    else {
+      res = copy_offload(in, fd, &st);
+      if (res == 1)
+	res = copy_rw(in, fd);
+    }
+    if (res == -1) {
+      perror("can not write file");
+      ret = 1;
+    }
+  }
+
+  // preallocated beyond a shorter stream, copy_direct cut the file already
+  // and its offset is at the padded end
+  if (ret == 0 && !direct && !S_ISREG(st.st_mode) && prealloc > 0) {
+    if (ftruncate(fd, lseek(fd, 0, SEEK_CUR)) == -1) {
+      perror("can not truncate file");
+      ret = 1;
+    }
+  }
+
+  if (close(fd) == -1 && ret == 0) {
+    perror("can not write file");
+    ret = 1;
+  }
+  if (in != STDIN_FILENO)
+    close(in);
+  return ret;
+}
+
+/* read the whole manifest into memory, return NULL on error */
+char *read_manifest(const char *path, size_t *len)
+{
+  char *buf;
+  char *p;
+  size_t size = 65536;
+  ssize_t n;
+  int fd = STDIN_FILENO;
+
+  if (strcmp(path, "-") != 0) {
+    fd = open(path, O_RDONLY);
+    if (fd == -1) {
+      perror("can not open manifest");
+      return NULL;
+    }
+  }
+
+  *len = 0;
+  buf = malloc(size);
+  while (buf != NULL) {
+    n = read(fd, buf + *len, size - *len - 1);
+    if (n <= 0) {
+      if (n == -1) {
+	perror("can not read manifest");
+	free(buf);
+	buf = NULL;
+      }
+      break;
+    }
+    *len += n;
+    if (*len + 1 == size) {
+      size *= 2;
+      p = realloc(buf, size);
+      if (p == NULL)
+	free(buf);
+      buf = p;
+    }
+  }
+  if (buf == NULL)
+    perror("can not load manifest");
+  else
+    buf[*len] = '\0'; // a last field without its nul still ends
+
+  if (fd != STDIN_FILENO)
+    close(fd);
+  return buf;
+}
+
+/* split the manifest into its records, return -1 on error */
+int parse_manifest(struct batch *b, size_t len)
+{
+  const char **p;
+  size_t cap = 0;
+  size_t pos = 0;
+
+  while (pos < len) {
+    if (b->count == cap) {
+      cap = cap ? cap * 2 : 1024;
+      if ((p = realloc(b->files, cap * sizeof *p)) != NULL)
+	b->files = p;
+      if (p == NULL || (p = realloc(b->strs, cap * sizeof *p)) == NULL) {
+	perror("can not parse manifest");
+	return -1;
+      }
+      b->strs = p;
+    }
+
+    b->files[b->count] = b->buf + pos;
+    pos += strlen(b->buf + pos) + 1;
+    // a last record "file\0" would read the nul read_manifest appends
+    // as an empty writestr and truncate the file
+    if (pos >= len) {
+      syslog(LOG_USER, "manifest record %zu has no writestr", b->count + 1);
+      return -1;
+    }
+    b->strs[b->count] = b->buf + pos;
+    pos += strlen(b->buf + pos) + 1;
+    b->count++;
+  }
   return 0;
 }
 
+void *batch_worker(void *arg)
+{
+  struct batch *b = arg;
+  size_t i;
+
+  while ((i = __atomic_fetch_add(&b->next, 1, __ATOMIC_RELAXED)) < b->count) {
+    if (writer(b->files[i], b->strs[i]) != 0) {
+      __atomic_fetch_add(&b->failed, 1, __ATOMIC_RELAXED);
+    }
+  }
+  return NULL;
+}
+
+/* write every record of the manifest, return 1 if any of them failed */
+int batch_writer(const char *manifest, int nthreads)
+{
+  pthread_t threads[MAX_THREADS];
+  struct batch b;
+  size_t len;
+  int started = 0;
+  int ret;
+
+  memset(&b, 0, sizeof b);
+  b.buf = read_manifest(manifest, &len);
+  if (b.buf == NULL)
+    return 1;
+  if (parse_manifest(&b, len) == -1) {
+    ret = 1;
+  }
+  else {
+    // the calling thread works too, it covers for any thread not started
+    for (started = 0; started < nthreads - 1; started++) {
+      ret = pthread_create(&threads[started], NULL, batch_worker, &b);
+      if (ret) {
+	errno = ret;
+	perror("pthread_create");
+	break;
+      }
+    }
+    batch_worker(&b);
+    while (started > 0)
+      pthread_join(threads[--started], NULL);
+
+    syslog(LOG_USER, "wrote %zu of %zu files", b.count - b.failed, b.count);
+    ret = b.failed ? 1 : 0;
+  }
+
+  free(b.files);
+  free(b.strs);
+  free(b.buf);
+  return ret;
+}
+
 int main(int argc, char **argv)
 {
+  const char *manifest = NULL;
+  const char *source = NULL;
+  off_t prealloc = 0;
+  int direct = 0;
+  long nthreads;
+  int ret;
+  int c;
+
   openlog(NULL, LOG_CONS, LOG_USER);
+
+  nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+  // "+": stop at the first writefile, writestr may start with a '-'
+  while ((c = getopt(argc, argv, "+b:j:i:p:D")) != -1) {
+    if (c == 'b') {
+      manifest = optarg;
+    }
+    else if (c == 'j') {
+      nthreads = atol(optarg);
+    }
+    else if (c == 'i') {
+      source = optarg;
+    }
+    else if (c == 'p') {
+      prealloc = strtoll(optarg, NULL, 0);
+    }
+    else if (c == 'D') {
+      direct = 1;
+    }
+    else {
+      syslog(LOG_USER, "%s", "usage: writer writefile writestr | writer -b manifest [-j threads]"
+	     " | writer -i source [-p size] [-D] writefile");
+      return 1;
+    }
+  }
+
+  if (manifest != NULL) {
+    if (optind < argc) {
+      syslog(LOG_USER, "%s", "too many arguments");
+      return 1;
+    }
+    if (nthreads < 1)
+      nthreads = 1;
+    if (nthreads > MAX_THREADS)
+      nthreads = MAX_THREADS;
+    ret = batch_writer(manifest, nthreads);
+    closelog();
+    return ret;
+  }
+
+  argc -= optind - 1;
+  argv += optind - 1;
+  if (source != NULL) {
+    if (argc != 2) {
+      syslog(LOG_USER, "%s", argc < 2 ? "missing writefile" : "too many arguments");
+      return 1;
+    }
+    ret = writer_stream(argv[1], source, prealloc, direct);
+    closelog();
+    return ret;
+  }
+
   if (argc < 2) {
     syslog(LOG_USER, "%s", "missing writefile and writestr");
     return 1;
   }
-  
+
   else if (argc < 3) {
     syslog(LOG_USER, "%s", "missing 1 of 2 required arguments");
     return 1;
@@ -46,7 +474,7 @@ int main(int argc, char **argv)
     return 1;
   }
 
-  writer(argv[1], argv[2]);
+  ret = writer(argv[1], argv[2]);
   closelog();
-  return 0;
+  return ret;
 }
@@ -29,6 +29,7 @@
  */
 
 
+#define _GNU_SOURCE    // fallocate
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <sys/socket.h>
@@ -42,6 +43,45 @@
 #include <fcntl.h>
 #include <unistd.h>
 #include <syslog.h>
+#include <poll.h>
+#include <stdint.h>
+#include <time.h>
+#include <sys/timerfd.h>
+#include <sys/un.h>
+#include <stddef.h>    // offsetof
+#include <linux/falloc.h>
+#include <sys/file.h>  // flock
+#include <limits.h>    // PATH_MAX
+#include "lz.h"
+#include "aesdtrace.h"
+#include "replay.h"
+
+#define DATAFILE "/var/tmp/aesdsocketdata"
+#define LOCKSUFFIX ".lock"  // next to the log, replays against hole punching
+#define MAX_LISTENERS 3  // tcp, unix path and unix abstract
+
+struct server_config {
+  int daemon_mode;
+  const char *datafile;   // the log
+  const char *port;       // TCP listener port, "0" for none
+  int timestamp_interval; // seconds between timestamp lines, 0 disables them
+  const char *unix_path;  // optional UNIX domain listener on this path
+  const char *unix_abstract; // optional UNIX domain listener, abstract name
+  size_t zerocopy_threshold; // replays this large use MSG_ZEROCOPY, 0 never
+  size_t segment_size;    // seal the log tail into compressed segments, 0 never
+};
+
+/* sealing state, kept by the listening process */
+struct sealer {
+  const char *datafile;
+  size_t segment_size;
+  int lockfd;
+  unsigned int nsegs;    // number of the next segment
+  uint64_t sealed_end;   // log bytes held by segments
+  uint64_t punched_end;  // log bytes given back by the tail file
+  uint64_t raw_total;    // stats
+  uint64_t stored_total;
+};
 
 
 void showipinfo(const struct addrinfo *p)
@@ -106,6 +146,9 @@ void sigchld_handler()
 
 void *get_in_addr(struct sockaddr *sa)
 {
+    if (sa->sa_family == AF_UNIX) {
+	return NULL;
+    }
     if (sa->sa_family == AF_INET) {
         return &(((struct sockaddr_in*)sa)->sin_addr);
     }
@@ -114,12 +157,11 @@ void *get_in_addr(struct sockaddr *sa)
 }
 
 /*
-  would need an argument for PORT, 
-  but the assignment has port fixe at 9000, so skip the argument for now
+  TCP listener on port, 9000 unless the -p option says otherwise
   return -1 if fail else return file descriptor
   
  */
-int get_listener_fd()
+int get_listener_fd(const char *port)
 {
   /* getaddrinfo; */
   int status;
@@ -132,7 +174,7 @@ int get_listener_fd()
   hints.ai_flags = AI_PASSIVE;     // fill in my IP for me
 
   // port is the service we are providing so we know that
-  if ((status = getaddrinfo(NULL, "9000", &hints, &servinfo)) != 0) {
+  if ((status = getaddrinfo(NULL, port, &hints, &servinfo)) != 0) {
     /* fprintf(stderr, "getaddrinfo error: %s\n", gai_strerror(status)); */
     perror("getaddrinfo error");
     exit(1);
@@ -183,78 +225,327 @@ int get_listener_fd()
   return sfd;
 }
 
-// res is the length of substr that ends with c or limit if c not found
-int scanfor(char *buf, char c, size_t limit, size_t *pos)
+/*
+  UNIX domain stream listener for clients on the same host, skips the
+  TCP/IP stack. name is a filesystem path, or a name in the abstract
+  namespace when abstract is set (no file is created for those)
+  return -1 if fail else return file descriptor
+ */
+int get_unix_listener_fd(const char *name, int abstract)
 {
-  int res = 0;
-  size_t index = 0;
-  char *p = buf;
-  
-  for (index = 0; index < limit; p++, index++)
+  struct sockaddr_un addr;
+  socklen_t addr_len;
+  size_t len = strlen(name);
+  struct stat st;
+  int sfd;
+
+  memset(&addr, 0, sizeof addr);
+  addr.sun_family = AF_UNIX;
+  // abstract names start with a nul byte, paths end with one
+  if (len + 1 > sizeof addr.sun_path)
+    {
+      fprintf(stderr, "server: unix socket name too long: %s\n", name);
+      exit(1);
+    }
+  if (abstract)
+    {
+      memcpy(addr.sun_path + 1, name, len);
+    }
+  else
     {
-      if (*p == c)
+      memcpy(addr.sun_path, name, len);
+      // a stale socket from a previous run, never anything else
+      if (lstat(name, &st) == 0)
 	{
-	  break;
+	  if (!S_ISSOCK(st.st_mode))
+	    {
+	      errno = EADDRINUSE;
+	      fprintf(stderr, "server: %s is not a socket: %s\n", name, strerror(errno));
+	      exit(1);
+	    }
+	  unlink(name);
 	}
     }
-  
-  *pos = index;
-  
-  //if (*p == c)
-  if (index < limit)
+  addr_len = offsetof(struct sockaddr_un, sun_path) + len + 1;
+
+  sfd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (sfd == -1)
     {
-      res =  0;
+      perror("socket error");
+      exit(1);
     }
-  else
-    //if (*pos == limit)
+
+  if (bind(sfd, (struct sockaddr *) &addr, addr_len) == -1)
     {
-      res = 1;
-      p--; // p points outside buffer so is undefined 
+      perror("bind error");
+      close(sfd);
+      exit(1);
     }
-  syslog(LOG_DEBUG, "*buf = %02x, index = %ld, return value = %d", *p, index, res);
-  return res;
+  printf("bind success\n  unix: %s%s\n", abstract ? "@" : "", name);
+
+  return sfd;
 }
 
-/* send all message in logfd, though fd */
-int send_all(int fd, int logfd, char *buf, size_t buf_size)
+/* append one complete record to the data log.
+   logfd is opened with O_APPEND, so every record goes to the end of file
+   in a single write: client packets and timestamps never interleave, and
+   the connection processes need no lock between them
+   return -1 on error */
+int append_record(int logfd, const char *buf, size_t len)
 {
-  // read from logfd
-  size_t bytesread=1;
+  ssize_t n;
 
-  lseek(logfd, 0, SEEK_SET);
-  while (bytesread > 0)
+  while (len > 0)
     {
-      bytesread = read(logfd, buf, buf_size);
-      if (bytesread==-1)
+      n = write(logfd, buf, len);
+      if (n == -1)
 	{
-	  perror("read error");
-	  syslog(LOG_DEBUG, "error in reading data log");
+	  if (errno == EINTR)
+	    continue;
+	  perror("write message to file error");
+	  syslog(LOG_DEBUG, "write message to file error");
 	  return -1;
 	}
-      if (bytesread == 0)
-	return 0;
+      buf += n;
+      len -= n;
+    }
+  return 0;
+}
+
+/* append an RFC 2822 "timestamp:" line, same path as client packets */
+int append_timestamp(int logfd)
+{
+  char tsbuf[128];
+  struct tm tm;
+  time_t now;
+  size_t len;
+
+  now = time(NULL);
+  if (localtime_r(&now, &tm) == NULL)
+    {
+      perror("localtime_r error");
+      return -1;
+    }
+  len = strftime(tsbuf, sizeof tsbuf, "timestamp:%a, %d %b %Y %T %z\n", &tm);
+  if (len == 0)
+    {
+      syslog(LOG_DEBUG, "strftime error");
+      return -1;
+    }
+  syslog(LOG_DEBUG, "append %s", tsbuf);
+  if (append_record(logfd, tsbuf, len) == -1)
+    return -1;
+  AESD_TRACE2(committed, 0, len);
+  return 0;
+}
+
+/*
+  periodic timer for the timestamp lines, polled next to the listener
+  return -1 if fail else return file descriptor
+ */
+int get_timer_fd(int interval)
+{
+  struct itimerspec its;
+  int tfd;
+
+  tfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK|TFD_CLOEXEC);
+  if (tfd == -1)
+    {
+      perror("timerfd_create error");
+      return -1;
+    }
+
+  memset(&its, 0, sizeof its);
+  its.it_value.tv_sec = interval;
+  its.it_interval.tv_sec = interval;
+  if (timerfd_settime(tfd, 0, &its, NULL) == -1)
+    {
+      perror("timerfd_settime error");
+      close(tfd);
+      return -1;
+    }
+  return tfd;
+}
+
+/* write a segment under a temporary name and rename it into place, so a
+   replay never finds half of one */
+int write_segment(const char *datafile, unsigned int idx, const struct segment_header *hdr,
+		  const unsigned char *payload)
+{
+  char path[PATH_MAX];
+  char tmppath[PATH_MAX + 8];
+  int sfd;
+  int res = 0;
 
-      syslog(LOG_DEBUG,"sending %ld bytes back to client", bytesread);
-      if(send(fd, buf, bytesread, 0) == -1)
+  segment_path(path, sizeof path, datafile, idx);
+  snprintf(tmppath, sizeof tmppath, "%s.tmp", path);
+  sfd = open(tmppath, O_WRONLY|O_CREAT|O_TRUNC, 0644);
+  if (sfd == -1)
+    {
+      perror("open segment error");
+      return -1;
+    }
+  if (append_record(sfd, (const char *) hdr, sizeof *hdr) == -1
+      || append_record(sfd, (const char *) payload, hdr->size) == -1)
+    {
+      res = -1;
+    }
+  close(sfd);
+  if (res == 0 && rename(tmppath, path) == -1)
+    {
+      perror("rename segment error");
+      res = -1;
+    }
+  if (res == -1)
+    unlink(tmppath);
+  return res;
+}
+
+/* give the sealed part of the tail back to the file system.  a replay that
+   listed the segments before the newest one was sealed may still read this
+   range from the tail, so it waits until no replay runs (next round) */
+void punch_tail(int logfd, struct sealer *sl)
+{
+  if (flock(sl->lockfd, LOCK_EX|LOCK_NB) == -1)
+    {
+      return;
+    }
+  if (fallocate(logfd, FALLOC_FL_PUNCH_HOLE|FALLOC_FL_KEEP_SIZE,
+		sl->punched_end, sl->sealed_end - sl->punched_end) == -1)
+    {
+      // the data stays readable, only its space is not reclaimed
+      perror("fallocate punch hole error");
+    }
+  sl->punched_end = sl->sealed_end;
+  flock(sl->lockfd, LOCK_UN);
+}
+
+/* pick up the segments of an earlier run.  they only belong to the tail if
+   the tail still has everything they hold, otherwise they are removed */
+void sealer_init(int logfd, struct sealer *sl)
+{
+  struct segment_header hdr;
+  unsigned char *payload;
+  struct stat st;
+  char path[PATH_MAX];
+
+  while (read_segment(sl->datafile, sl->nsegs, &hdr, &payload) == 0)
+    {
+      free(payload);
+      sl->nsegs++;
+      sl->sealed_end = hdr.end;
+    }
+  if (fstat(logfd, &st) == 0 && (uint64_t) st.st_size >= sl->sealed_end)
+    {
+      sl->punched_end = sl->sealed_end;
+      return;
+    }
+
+  syslog(LOG_DEBUG, "removing %u stale segments", sl->nsegs);
+  while (sl->nsegs > 0)
+    {
+      segment_path(path, sizeof path, sl->datafile, --sl->nsegs);
+      unlink(path);
+    }
+  sl->sealed_end = 0;
+}
+
+/* once segment_size bytes were appended since the last segment, compress
+   them into a new one and release them from the tail.  the active tail is
+   left alone, appends go on while this runs
+   return -1 on error */
+int seal_segment(int logfd, struct sealer *sl)
+{
+  struct segment_header hdr;
+  struct stat st;
+  unsigned char *raw;
+  unsigned char *packed;
+  size_t len;
+  int res = -1;
+
+  if (sl->punched_end < sl->sealed_end)
+    punch_tail(logfd, sl);
+
+  if (fstat(logfd, &st) == -1)
+    {
+      perror("fstat error");
+      return -1;
+    }
+  if ((uint64_t) st.st_size < sl->sealed_end + sl->segment_size)
+    return 0;
+
+  len = st.st_size - sl->sealed_end;
+  raw = malloc(len);
+  packed = malloc(lz_compress_bound(len));
+  if (raw != NULL && packed != NULL && pread_full(logfd, raw, len, sl->sealed_end) == 0)
+    {
+      memset(&hdr, 0, sizeof hdr);
+      memcpy(hdr.magic, SEGMENT_MAGIC, sizeof hdr.magic);
+      hdr.start = sl->sealed_end;
+      hdr.end = st.st_size;
+      hdr.size = lz_compress(raw, len, packed, lz_compress_bound(len));
+      if (hdr.size == 0 || hdr.size >= len)
 	{
-	  perror("send error");
-	  syslog(LOG_DEBUG, "error sending data back");
+	  hdr.flags = SEGMENT_STORED;
+	  hdr.size = len;
 	}
+      res = write_segment(sl->datafile, sl->nsegs, &hdr, hdr.flags & SEGMENT_STORED ? raw : packed);
     }
+  else
+    {
+      perror("seal segment error");
+    }
+  free(raw);
+  free(packed);
+  if (res == -1)
+    return -1;
+
+  sl->nsegs++;
+  sl->sealed_end = hdr.end;
+  sl->raw_total += len;
+  sl->stored_total += hdr.size;
+  syslog(LOG_INFO, "stats: sealed segment %u, %lu -> %lu bytes, ratio %.2f, all segments %.2f",
+	 sl->nsegs - 1, (unsigned long) len, (unsigned long) hdr.size,
+	 (double) len / hdr.size, (double) sl->raw_total / sl->stored_total);
+
+  punch_tail(logfd, sl);
   return 0;
 }
 
 
-int service(int fd, int logfd)
+int service(int fd, int logfd, const struct server_config *cfg, unsigned long conn_id)
 {
   char *recvbuf;  // receiving buffer
   char *sendbuf;  // sending buffer
+  char *msgbuffer; // packet being assembled, written to the log once complete
   size_t recvbuf_size = 2048;
-  size_t sendbuf_size = 2048;
-  size_t nbytes;
+  size_t sendbuf_size = REPLAY_CHUNK;
+  size_t msgbuffer_size = 2048;
+  size_t messagesize = 0;
+  size_t received = 0;
+  ssize_t nbytes;
 
+  size_t start;
   size_t position;
   int res;
+  int err = 0;
+  struct replay rp;
+  char lockpath[PATH_MAX];
+
+  memset(&rp, 0, sizeof rp);
+  rp.zerocopy_threshold = cfg->zerocopy_threshold;
+  rp.lockfd = -1;
+  rp.conn_id = conn_id;
+  rp.cache.datafile = cfg->datafile;
+  if (cfg->segment_size > 0)
+    {
+      // an open of our own, flock is shared by everything on one open file
+      rp.segments = 1;
+      snprintf(lockpath, sizeof lockpath, "%s" LOCKSUFFIX, cfg->datafile);
+      rp.lockfd = open(lockpath, O_RDONLY);
+      if (rp.lockfd == -1)
+	perror("open lock file error");
+    }
 
   // allocate recv/send buffer for new connection
   recvbuf = malloc(recvbuf_size);
@@ -272,9 +563,17 @@ int service(int fd, int logfd)
       exit(1);
     }
   syslog(LOG_DEBUG, "sendbuf pointer = %p", sendbuf);
+
+  msgbuffer = malloc(msgbuffer_size);
+  if (msgbuffer == NULL)
+    {
+      perror("malloc error 4");
+      exit(1);
+    }
+  syslog(LOG_DEBUG, "msgbuffer pointer = %p", msgbuffer);
   
   // the loop of receiving
-  while(1)
+  while(err == 0)
     {
       // try to receive upto 2048 bytes,
       nbytes = recv(fd, recvbuf, recvbuf_size, 0);
@@ -292,106 +591,74 @@ int service(int fd, int logfd)
 	  syslog(LOG_DEBUG, "-- connection closed");
 	  break;
 	}
+      AESD_TRACE2(recv, conn_id, nbytes);
+      received += nbytes;
 
-      // write to logfd2
-      // syslog(LOG_DEBUG,"write recvbuf to my log file");
-      /* if (write(logfd2, recvbuf, nbytes) == -1) */
-      /* 	{ */
-      /* 	  perror("write logfd2 error"); */
-      /* 	  syslog(LOG_DEBUG,"write recvbuf to my log file ERROR"); */
-      /* 	  break; */
-      /* 	} */
-
-      // now nbytes in recvbuf
-      // scan received buffer for a pattern, upto nbytes
-      res = scanfor(recvbuf, '\n', nbytes, &position);
-      if (res == 0)
-	{
-	  position++;
-	}
-      // syslog(LOG_DEBUG,"nbytes = %ld, res = %d, position = %ld, messagesize = %ld, freespace = %ld", nbytes,res, position, messagesize, freespace);
-      // append message to messagebuffer
-      /* memcpy(wptr, recvbuf, position); */
-      /* messagesize += position; */
-      // update wptr
-      /* wptr += position; */
-      /* freespace -= position; */
-      // syslog(LOG_DEBUG,"after memcpy, nbytes = %ld, res = %d, position = %ld, messagesize = %ld, freespace = %ld", nbytes,res, position, messagesize, freespace);
-      // double buffer size if freespace < recvbuf_size
-      /* if (freespace <= recvbuf_size) */
-      /* 	{ */
-      /* 	  msgbuffer_size *= 2; */
-      /* 	  syslog(LOG_DEBUG, "freespace = %ld, calling realloc with new buffer size = %ld", freespace, msgbuffer_size); */
-	  
-      /* 	  msgbuffer = (char *)realloc((void *)msgbuffer, msgbuffer_size); */
-      /* 	  if (msgbuffer  == NULL) */
-      /* 	    { */
-      /* 	      syslog(LOG_DEBUG, "realloc msgbuffer error!!"); */
-      /* 	      perror("realloc msgbuffer error"); */
-      /* 	      break; // exit loop */
-      /* 	    } */
-
-      /* 	  syslog(LOG_DEBUG, "new pointer = %p", msgbuffer); */
-      /* 	  // update freespace */
-      /* 	  freespace = msgbuffer_size - messagesize; */
-      /* 	  // syslog(LOG_DEBUG, "new freespace = %ld", freespace); */
-
-      /* 	} */
-      // write message buffer to logfd
-      syslog(LOG_DEBUG, "write %ld bytes to file", position);
-      if (write(logfd, recvbuf, position) == -1)
+      // now nbytes in recvbuf, there may be more than one packet in it;
+      // nbytes > 0 here, so the cast is safe
+      for (start = 0; start < (size_t) nbytes; start += position)
 	{
-	  perror("write message to file error");
-	  syslog(LOG_DEBUG,"write message to file error");
-	  break;
-	}
+	  // scan received buffer for a pattern, upto nbytes
+	  res = scanfor(recvbuf + start, '\n', nbytes - start, &position);
+	  if (res == 0)
+	    {
+	      position++;
+	    }
 
-      if (res == 0)
-	{
-	  // syslog(LOG_DEBUG, "write %ld bytes to file", messagesize);
-	  /* syslog(LOG_DEBUG, "write %ld bytes to file", position); */
-	  /* if (write(logfd, recvbuf, position) == -1) */
-	  /*   { */
-	  /*     perror("write message to file error"); */
-	  /*     syslog(LOG_DEBUG,"write message to file error"); */
-	  /*     break; */
-	  /*   } */
-	  /* if (write(logfd, msgbuffer, messagesize) == -1) */
-	  /*   { */
-	  /*     perror("write message to file error"); */
-	  /*     syslog(LOG_DEBUG,"write message to file error"); */
-	  /*     break; */
-	  /*   } */
-	  // clear message buffer
-	  /* messagesize = 0; */
-	  /* wptr = msgbuffer; */
-
-	  // copy anything after pattern to msgbuffer;
-	  /* if (position < nbytes-1) */
-	  /*   { */
-	  /*     memcpy(wptr, recvbuf+position, nbytes-1-position); */
-	  /*     wptr += nbytes-1-position; */
-	  /*   } */
-	  // send all received message back
-	  if (send_all(fd, logfd, sendbuf, sendbuf_size) == -1)
+	  // double buffer size until the packet fits
+	  if (messagesize + position > msgbuffer_size)
 	    {
-	      //break;
+	      char *p;
+
+	      while (messagesize + position > msgbuffer_size)
+		msgbuffer_size *= 2;
+	      syslog(LOG_DEBUG, "calling realloc with new buffer size = %ld", msgbuffer_size);
+	      p = realloc(msgbuffer, msgbuffer_size);
+	      if (p == NULL)
+		{
+		  syslog(LOG_DEBUG, "realloc msgbuffer error!!");
+		  perror("realloc msgbuffer error");
+		  err = 1;
+		  break;
+		}
+	      msgbuffer = p;
 	    }
-	  // write the rest
-	  if (position < nbytes)
+	  memcpy(msgbuffer + messagesize, recvbuf + start, position);
+	  messagesize += position;
+
+	  if (res == 0)
 	    {
-	      if (write(logfd, recvbuf+position, nbytes-position) == -1)
+	      // complete packet, write it to the log in one piece
+	      AESD_TRACE2(framed, conn_id, messagesize);
+	      syslog(LOG_DEBUG, "write %ld bytes to file", messagesize);
+	      if (append_record(logfd, msgbuffer, messagesize) == -1)
 		{
-		  perror("write message to file error");
-		  syslog(LOG_DEBUG,"write message to file error");
+		  err = 1;
 		  break;
 		}
+	      AESD_TRACE2(committed, conn_id, messagesize);
+	      messagesize = 0;
+
+	      // send all received message back
+	      if (send_all(fd, logfd, sendbuf, sendbuf_size, &rp) == -1)
+		{
+		  //break;
+		}
 	    }
 	}
     }
+
+  // keep an unterminated packet, the client will not complete it anymore
+  if (messagesize > 0)
+    {
+      syslog(LOG_DEBUG, "write %ld bytes of partial packet to file", messagesize);
+      if (append_record(logfd, msgbuffer, messagesize) == 0)
+	AESD_TRACE2(committed, conn_id, messagesize);
+    }
+  AESD_TRACE2(close, conn_id, received);
   
   syslog(LOG_DEBUG, "remving aesdsocketdata file");
-  unlink("/var/tmp/aesdsocketdata");
+  unlink(cfg->datafile);
   if (sendbuf != NULL)
     {
       syslog(LOG_DEBUG, "freeing sendbuf %p ", sendbuf);
@@ -402,29 +669,52 @@ int service(int fd, int logfd)
       syslog(LOG_DEBUG, "freeing recvbuf %p ", recvbuf);
       free(recvbuf);
     }
-  /* if (msgbuffer != NULL) */
-  /*   { */
-  /*     syslog(LOG_DEBUG, "freeing msgbuffer %p", msgbuffer); */
-  /*     free(msgbuffer); */
-  /*   } */
+  if (msgbuffer != NULL)
+    {
+      syslog(LOG_DEBUG, "freeing msgbuffer %p", msgbuffer);
+      free(msgbuffer);
+    }
+  if (rp.cache.compressed > 0)
+    {
+      syslog(LOG_INFO, "stats: replay cache %lu bytes from %lu compressed, ratio %.2f, decompressed at %.1f MB/s",
+	     (unsigned long) rp.cache.size, (unsigned long) rp.cache.compressed,
+	     (double) rp.cache.size / rp.cache.compressed,
+	     rp.cache.seconds > 0 ? rp.cache.size / rp.cache.seconds / 1e6 : 0.0);
+    }
+  free(rp.cache.buf);
+  if (rp.lockfd != -1)
+    close(rp.lockfd);
   
   return nbytes;
 }
 
 
-int server(int daemon_mode)
+int server(const struct server_config *cfg)
 {
-  // get a socket for listenning 
-  int sfd = get_listener_fd();
+  // get sockets for listenning 
+  int lfds[MAX_LISTENERS];
+  int nlfds = 0;
+  int tfd = -1;
+  int i;
+  struct sealer sl;
+  char lockpath[PATH_MAX];
   pid_t pid, sid;
 
+  if (strcmp(cfg->port, "0") != 0)
+    lfds[nlfds++] = get_listener_fd(cfg->port);
+  if (cfg->unix_path != NULL)
+    lfds[nlfds++] = get_unix_listener_fd(cfg->unix_path, 0);
+  if (cfg->unix_abstract != NULL)
+    lfds[nlfds++] = get_unix_listener_fd(cfg->unix_abstract, 1);
+
   // daemonize
-  if (daemon_mode)
+  if (cfg->daemon_mode)
     {
       pid = fork();
       if (pid < 0)
 	{ // fail
-	  close(sfd);
+	  for (i = 0; i < nlfds; i++)
+	    close(lfds[i]);
 	  exit(EXIT_FAILURE);
 	}
 
@@ -460,25 +750,59 @@ int server(int daemon_mode)
       /* Daemon-specific initialization goes here */
     }// daemon_mode
   
-  // open log file 
-  int logfd = open("/var/tmp/aesdsocketdata", O_RDWR|O_CREAT, S_IRWXU|S_IRGRP|S_IXGRP|S_IROTH|S_IXOTH);
+  // open log file, every write goes to the end of it
+  int logfd = open(cfg->datafile, O_RDWR|O_CREAT|O_APPEND, S_IRWXU|S_IRGRP|S_IXGRP|S_IROTH|S_IXOTH);
   if (logfd == -1) 
     {
       perror("open error");
-      close(sfd);
+      for (i = 0; i < nlfds; i++)
+	close(lfds[i]);
       exit(1);
     }
 
   // create a new sid for the child process
   
   // listen
-  if (listen(sfd, 10) != 0)
+  for (i = 0; i < nlfds; i++)
     {
-      perror("listen error");
+      if (listen(lfds[i], 10) != 0)
+	{
+	  perror("listen error");
+	}
     }
 
   openlog(NULL, LOG_PID|LOG_PERROR, LOG_USER);
 
+  // timestamp timer, served by this loop so it needs no thread of its own
+  if (cfg->timestamp_interval > 0)
+    {
+      tfd = get_timer_fd(cfg->timestamp_interval);
+      if (tfd == -1)
+	{
+	  syslog(LOG_DEBUG, "timestamps disabled");
+	}
+    }
+
+  // sealing of the log tail into compressed segments, also run by this loop
+  memset(&sl, 0, sizeof sl);
+  sl.datafile = cfg->datafile;
+  sl.segment_size = cfg->segment_size;
+  sl.lockfd = -1;
+  if (sl.segment_size > 0)
+    {
+      snprintf(lockpath, sizeof lockpath, "%s" LOCKSUFFIX, cfg->datafile);
+      sl.lockfd = open(lockpath, O_RDWR|O_CREAT, 0644);
+      if (sl.lockfd == -1)
+	{
+	  perror("open lock file error");
+	  sl.segment_size = 0;
+	}
+      else
+	{
+	  sealer_init(logfd, &sl);
+	}
+    }
+
   // sigaction
   struct sigaction sa;
   sa.sa_handler = sigchld_handler; // reap all dead processes
@@ -487,11 +811,13 @@ int server(int daemon_mode)
   if (sigaction(SIGCHLD, &sa, NULL) == -1) {
     perror("sigaction");
     syslog(LOG_DEBUG, "Caught signal, existing");
-    close(sfd);
+    for (i = 0; i < nlfds; i++)
+      close(lfds[i]);
     close(logfd);
-    //    close(logfd2);
+    if (tfd != -1)
+      close(tfd);
     closelog();
-    unlink("/var/tmp/aesdsocketdata");
+    unlink(cfg->datafile);
     unlink("/var/tmp/mylog");
     exit(1);
   }
@@ -501,8 +827,62 @@ int server(int daemon_mode)
   socklen_t addr_size;
   struct sockaddr_storage peer_addr;
   char peerhostname[INET6_ADDRSTRLEN];
+  unsigned long conn_id = 0;
+  struct pollfd pfds[MAX_LISTENERS + 1];
+  nfds_t npfds = nlfds;
+  uint64_t expirations;
+  int sfd;
+
+  // every listener is served the same way, the timer goes last
+  for (i = 0; i < nlfds; i++)
+    {
+      pfds[i].fd = lfds[i];
+      pfds[i].events = POLLIN;
+    }
+  if (tfd != -1)
+    {
+      pfds[npfds].fd = tfd;
+      pfds[npfds].events = POLLIN;
+      npfds++;
+    }
+
   while(1)
     {
+      // SIGCHLD interrupts poll even with SA_RESTART
+      // wake up every second to check the tail size when sealing
+      if (poll(pfds, npfds, sl.segment_size > 0 ? 1000 : -1) == -1)
+	{
+	  if (errno != EINTR)
+	    perror("poll error");
+	  continue;
+	}
+
+      if (sl.segment_size > 0)
+	{
+	  seal_segment(logfd, &sl);
+	}
+
+      if (tfd != -1 && (pfds[nlfds].revents & POLLIN))
+	{
+	  // one line per wakeup even if expirations were missed
+	  if (read(tfd, &expirations, sizeof expirations) == sizeof expirations)
+	    {
+	      append_timestamp(logfd);
+	    }
+	}
+
+      // first listener with a pending connection
+      for (i = 0; i < nlfds; i++)
+	{
+	  if (pfds[i].revents & POLLIN)
+	    break;
+	}
+      if (i == nlfds)
+	{
+	  continue;
+	}
+      sfd = lfds[i];
+
       addr_size = sizeof peer_addr;
       afd = accept(sfd, (struct sockaddr *) &peer_addr, &addr_size);
       if (afd == -1)
@@ -511,11 +891,20 @@ int server(int daemon_mode)
 	  continue;
 	}
 
-      inet_ntop(peer_addr.ss_family,
-		get_in_addr((struct sockaddr *) &peer_addr),
-		peerhostname,
-		sizeof(peerhostname));
+      if (peer_addr.ss_family == AF_UNIX)
+	{
+	  strcpy(peerhostname, "local");
+	}
+      else
+	{
+	  inet_ntop(peer_addr.ss_family,
+		    get_in_addr((struct sockaddr *) &peer_addr),
+		    peerhostname,
+		    sizeof(peerhostname));
+	}
       syslog(LOG_DEBUG, "Accepted connection form %s \n", peerhostname);
+      conn_id++;
+      AESD_TRACE2(accept, conn_id, peer_addr.ss_family);
 
 
       // fork a child
@@ -530,10 +919,14 @@ int server(int daemon_mode)
       if (pid == 0) // fork return 0 in child process
 	{
 	  size_t n;
-	  close(sfd); // child does not need to listen
+	  for (i = 0; i < nlfds; i++)
+	    close(lfds[i]); // child does not need to listen
+	  if (tfd != -1)
+	    close(tfd); // nor the timer
+	  if (sl.lockfd != -1)
+	    close(sl.lockfd); // the connection opens its own
 
-	  //n = service(afd, logfd, logfd2);
-	  n = service(afd, logfd);
+	  n = service(afd, logfd, cfg, conn_id);
 	  syslog(LOG_DEBUG, "service returned value = %ld\n", n);
 	  if(n == 0)
 	    {
@@ -552,10 +945,16 @@ int server(int daemon_mode)
     }
   
   // close
-  close(sfd);
+  for (i = 0; i < nlfds; i++)
+    close(lfds[i]);
+  if (cfg->unix_path != NULL)
+    unlink(cfg->unix_path);
   close(logfd);
-  //close(logfd2);
-  if (daemon_mode == 1)
+  if (tfd != -1)
+    close(tfd);
+  if (sl.lockfd != -1)
+    close(sl.lockfd);
+  if (cfg->daemon_mode == 1)
     {
       exit(EXIT_SUCCESS);
     }
@@ -565,16 +964,64 @@ int server(int daemon_mode)
 
 int main(int argc, char **argv)
 {
-  int daemon_mode = 0;
+  struct server_config cfg;
+
+  memset(&cfg, 0, sizeof cfg);
+  cfg.datafile = DATAFILE;
+  cfg.port = "9000";
+  cfg.timestamp_interval = 10;
+  cfg.zerocopy_threshold = 4 * 1024 * 1024;
 
+  /*
+    -d           run as a daemon
+    -t seconds   interval of the timestamp lines, 0 disables them
+    -u path      also listen on a UNIX domain socket at path
+    -a name      also listen on a UNIX domain socket in the abstract namespace
+    -z bytes     replays at least this large use MSG_ZEROCOPY, 0 disables it
+    -s bytes     seal the log into compressed segments of about this size
+    -f path      the log, DATAFILE by default; absolute with -d, which
+                 changes to /
+    -p port      TCP port, 9000 by default, 0 for UNIX domain sockets only
+   */
   int c;
-  while ((c = getopt (argc, argv, "d")) != -1)
+  while ((c = getopt (argc, argv, "dt:u:a:z:s:f:p:")) != -1)
     {
-      if (c == 'd')
+      switch (c)
 	{
-	  daemon_mode = 1;
+	case 'd':
+	  cfg.daemon_mode = 1;
+	  break;
+	case 't':
+	  cfg.timestamp_interval = atoi(optarg);
+	  break;
+	case 'u':
+	  cfg.unix_path = optarg;
+	  break;
+	case 'a':
+	  cfg.unix_abstract = optarg;
+	  break;
+	case 'z':
+	  cfg.zerocopy_threshold = strtoul(optarg, NULL, 0);
 	  break;
+	case 's':
+	  cfg.segment_size = strtoul(optarg, NULL, 0);
+	  break;
+	case 'f':
+	  cfg.datafile = optarg;
+	  break;
+	case 'p':
+	  cfg.port = optarg;
+	  break;
+	default:
+	  fprintf(stderr, "usage: %s [-d] [-t seconds] [-u path] [-a name] [-z bytes] [-s bytes]"
+		  " [-f path] [-p port]\n", argv[0]);
+	  return 1;
 	}
     }
-  return server(daemon_mode);
+  if (strcmp(cfg.port, "0") == 0 && cfg.unix_path == NULL && cfg.unix_abstract == NULL)
+    {
+      fprintf(stderr, "%s: -p 0 needs -u or -a\n", argv[0]);
+      return 1;
+    }
+  return server(&cfg);
 }
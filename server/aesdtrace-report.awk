@@ -0,0 +1,64 @@
+# aesdtrace-report.awk: per stage latency of the aesdsocket request lifecycle
+#
+# usage: awk -f aesdtrace-report.awk trace.txt
+#
+# Input lines are "nanoseconds probe connection bytes" as printed by
+# aesdtrace.bt; the probe may carry a "usdt:...:" prefix.  For perf, turn
+# "perf script" output into the same four columns first.
+#
+# stages, in microseconds:
+#   receive   first recv of a packet to its newline being found
+#   append    packet framed to packet committed to the log
+#   queue     packet committed to replay start
+#   replay    replay start to replay end
+#   request   first recv of a packet to the end of its replay
+#   connection accept to close
+
+function stage(name, us) {
+    n[name]++
+    sum[name] += us
+    if (!(name in min) || us < min[name]) min[name] = us
+    if (!(name in max) || us > max[name]) max[name] = us
+}
+
+{
+    t = $1; probe = $2; conn = $3
+    sub(/.*:/, "", probe)
+    if (conn == 0) next  # timestamp lines, not part of a request
+
+    if (probe == "accept") {
+        accepted[conn] = t
+    } else if (probe == "recv") {
+        if (!(conn in first)) first[conn] = t
+    } else if (probe == "framed") {
+        if (conn in first) stage("receive", (t - first[conn]) / 1000)
+        framed[conn] = t
+    } else if (probe == "committed") {
+        if (conn in framed) stage("append", (t - framed[conn]) / 1000)
+        committed[conn] = t
+        delete framed[conn]
+    } else if (probe == "replay_start") {
+        if (conn in committed) stage("queue", (t - committed[conn]) / 1000)
+        replaying[conn] = t
+        delete committed[conn]
+    } else if (probe == "replay_end") {
+        if (conn in replaying) stage("replay", (t - replaying[conn]) / 1000)
+        if (conn in first) stage("request", (t - first[conn]) / 1000)
+        delete replaying[conn]
+        delete first[conn]
+    } else if (probe == "close") {
+        if (conn in accepted) stage("connection", (t - accepted[conn]) / 1000)
+        delete accepted[conn]
+        delete first[conn]
+    }
+}
+
+END {
+    printf "%-12s %8s %12s %12s %12s\n", "stage", "count", "avg_us", "min_us", "max_us"
+    split("receive append queue replay request connection", order, " ")
+    for (i = 1; i <= 6; i++) {
+        s = order[i]
+        if (!(s in n)) continue
+        printf "%-12s %8d %12.1f %12.1f %12.1f\n", s, n[s], sum[s] / n[s], min[s], max[s]
+    }
+}
@@ -0,0 +1,82 @@
+/*
+  aesdtrace.h: static tracepoints along the aesdsocket request lifecycle
+
+  AESD_TRACE2(name, conn, bytes) places a USDT probe "aesdsocket:name"
+  with two arguments, the connection id and a byte count, 64 bit wide
+  (pointer sized with the fallback note on 32 bit targets).  A probe
+  is a single nop plus an ELF note telling perf or bpftrace where the
+  arguments live, so it costs nothing while no tracer is attached:
+
+    perf buildid-cache --add aesdsocket; perf probe sdt_aesdsocket:accept
+    bpftrace -e 'usdt:./aesdsocket:aesdsocket:recv { @[arg0] = sum(arg1); }'
+
+  The probes come from <sys/sdt.h> when the toolchain has it, else from
+  the minimal stapsdt note below.  Build with -DAESD_NO_TRACE to leave
+  them out altogether.
+
+  probes      arg0            arg1
+  accept      connection id   address family
+  recv        connection id   bytes received
+  framed      connection id   packet size
+  committed   connection id   bytes appended to the log (id 0: timestamp)
+  replay_start connection id  bytes to replay
+  replay_end  connection id   0 on success, -1 on error
+  close       connection id   bytes received on the connection
+ */
+#ifndef AESDTRACE_H
+#define AESDTRACE_H
+
+#include <stdint.h>
+
+#if defined(AESD_NO_TRACE)
+
+#define AESD_TRACE2(name, a1, a2) do { (void) (a1); (void) (a2); } while (0)
+
+#elif defined(__has_include) && __has_include(<sys/sdt.h>)
+
+#include <sys/sdt.h>
+#define AESD_TRACE2(name, a1, a2) \
+  DTRACE_PROBE2(aesdsocket, name, (uint64_t) (a1), (uint64_t) (a2))
+
+#else
+
+/* the note layout of <sys/sdt.h>, version 3, without semaphores.  the
+   addresses in the note and the arguments are pointer sized, as with
+   _SDT_ASM_ADDR there: a 64 bit argument would not fit one register of a
+   32 bit target */
+#if defined(__LP64__) || defined(_LP64)
+#define AESD_SDT_ADDR ".8byte"
+#define AESD_SDT_ARGS "8@%0 8@%1"
+#else
+#define AESD_SDT_ADDR ".4byte"
+#define AESD_SDT_ARGS "4@%0 4@%1"
+#endif
+
+#define AESD_TRACE2(name, a1, a2)					\
+  __asm__ __volatile__ ("990: nop\n"					\
+			".pushsection .note.stapsdt,\"?\",\"note\"\n"	\
+			".balign 4\n"					\
+			".4byte 992f-991f, 994f-993f, 3\n"		\
+			"991: .asciz \"stapsdt\"\n"			\
+			"992: .balign 4\n"				\
+			"993: " AESD_SDT_ADDR " 990b\n"			\
+			AESD_SDT_ADDR " _.stapsdt.base\n"		\
+			AESD_SDT_ADDR " 0\n"				\
+			".asciz \"aesdsocket\"\n"			\
+			".asciz \"" #name "\"\n"			\
+			".asciz \"" AESD_SDT_ARGS "\"\n"		\
+			"994: .balign 4\n"				\
+			".popsection\n"					\
+			".ifndef _.stapsdt.base\n"			\
+			".pushsection .stapsdt.base,\"aG\",\"progbits\",.stapsdt.base,comdat\n" \
+			".weak _.stapsdt.base\n"			\
+			".hidden _.stapsdt.base\n"			\
+			"_.stapsdt.base: .space 1\n"			\
+			".size _.stapsdt.base, 1\n"			\
+			".popsection\n"					\
+			".endif\n"					\
+			:: "nor" ((uintptr_t) (a1)), "nor" ((uintptr_t) (a2)))
+
+#endif
+
+#endif
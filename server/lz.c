@@ -0,0 +1,170 @@
+#include <stdint.h>
+#include <string.h>
+#include "lz.h"
+
+#define LZ_MIN_MATCH 4
+#define LZ_MAX_OFFSET 65535
+#define LZ_HASH_BITS 14
+
+static uint32_t read32(const unsigned char *p)
+{
+  uint32_t v;
+
+  memcpy(&v, p, sizeof v);
+  return v;
+}
+
+static uint32_t hash32(uint32_t v)
+{
+  return (v * 2654435761u) >> (32 - LZ_HASH_BITS);
+}
+
+/* write a length that did not fit in its nibble: 255s and a remainder */
+static size_t put_length(unsigned char *dst, size_t op, size_t len)
+{
+  while (len >= 255)
+    {
+      dst[op++] = 255;
+      len -= 255;
+    }
+  dst[op++] = len;
+  return op;
+}
+
+/* one sequence: literals [anchor, anchor+litlen), then a match unless
+   mlen is 0. return the new output position, 0 if dst is too small */
+static size_t put_sequence(unsigned char *dst, size_t op, size_t dst_size,
+			   const unsigned char *lit, size_t litlen,
+			   size_t offset, size_t mlen)
+{
+  size_t mcode = mlen ? mlen - LZ_MIN_MATCH : 0;
+
+  // token, both length tails, the literals and the offset at most
+  if (op + 1 + litlen / 255 + 1 + litlen + 2 + mcode / 255 + 1 > dst_size)
+    return 0;
+
+  dst[op++] = ((litlen < 15 ? litlen : 15) << 4) | (mcode < 15 ? mcode : 15);
+  if (litlen >= 15)
+    op = put_length(dst, op, litlen - 15);
+  memcpy(dst + op, lit, litlen);
+  op += litlen;
+  if (mlen == 0)
+    return op;
+
+  dst[op++] = offset & 0xff;
+  dst[op++] = offset >> 8;
+  if (mcode >= 15)
+    op = put_length(dst, op, mcode - 15);
+  return op;
+}
+
+size_t lz_compress_bound(size_t len)
+{
+  return len + len / 255 + 16;
+}
+
+size_t lz_compress(const unsigned char *src, size_t len,
+		   unsigned char *dst, size_t dst_size)
+{
+  uint32_t table[1 << LZ_HASH_BITS]; // position + 1 of the last 4 bytes seen
+  size_t ip = 0;
+  size_t anchor = 0;
+  size_t op = 0;
+  size_t ref, mlen;
+  uint32_t seq, h;
+
+  memset(table, 0, sizeof table);
+  while (ip + LZ_MIN_MATCH <= len)
+    {
+      seq = read32(src + ip);
+      h = hash32(seq);
+      ref = table[h];
+      table[h] = ip + 1;
+      if (ref == 0 || ip - (ref - 1) > LZ_MAX_OFFSET || read32(src + ref - 1) != seq)
+	{
+	  ip++;
+	  continue;
+	}
+
+      ref--;
+      for (mlen = LZ_MIN_MATCH; ip + mlen < len && src[ref + mlen] == src[ip + mlen]; mlen++)
+	;
+      op = put_sequence(dst, op, dst_size, src + anchor, ip - anchor, ip - ref, mlen);
+      if (op == 0)
+	return 0;
+      ip += mlen;
+      anchor = ip;
+    }
+
+  // the rest goes out as literals, this also marks the end of the block
+  return put_sequence(dst, op, dst_size, src + anchor, len - anchor, 0, 0);
+}
+
+/* read a length continued in 255s, return -1 past the end of src */
+static ssize_t get_length(const unsigned char *src, size_t len, size_t *ip)
+{
+  ssize_t total = 0;
+  unsigned char b;
+
+  do
+    {
+      if (*ip >= len)
+	return -1;
+      b = src[(*ip)++];
+      total += b;
+    }
+  while (b == 255);
+  return total;
+}
+
+ssize_t lz_decompress(const unsigned char *src, size_t len,
+		      unsigned char *dst, size_t dst_size)
+{
+  size_t ip = 0;
+  size_t op = 0;
+  size_t litlen, mlen, offset;
+  ssize_t extra;
+  unsigned char token;
+
+  while (ip < len)
+    {
+      token = src[ip++];
+
+      litlen = token >> 4;
+      if (litlen == 15)
+	{
+	  if ((extra = get_length(src, len, &ip)) < 0)
+	    return -1;
+	  litlen += extra;
+	}
+      if (litlen > len - ip || litlen > dst_size - op)
+	return -1;
+      memcpy(dst + op, src + ip, litlen);
+      ip += litlen;
+      op += litlen;
+
+      // literals only: that was the last sequence
+      if (ip == len)
+	break;
+
+      if (len - ip < 2)
+	return -1;
+      offset = src[ip] | (src[ip + 1] << 8);
+      ip += 2;
+      mlen = (token & 0x0f);
+      if (mlen == 15)
+	{
+	  if ((extra = get_length(src, len, &ip)) < 0)
+	    return -1;
+	  mlen += extra;
+	}
+      mlen += LZ_MIN_MATCH;
+      if (offset == 0 || offset > op || mlen > dst_size - op)
+	return -1;
+
+      // byte by byte, the match may overlap what it produces
+      for (; mlen > 0; mlen--, op++)
+	dst[op] = dst[op - offset];
+    }
+  return op;
+}
@@ -0,0 +1,26 @@
+/*
+  lz: small LZ77 block codec for the sealed aesdsocket log segments
+
+  The format is close to an LZ4 block: sequences of a token byte (literal
+  count in the high nibble, match length - 4 in the low one, 15 meaning
+  more length bytes follow), the literals, then a 2 byte little endian
+  match offset. The last sequence has literals only.
+ */
+#ifndef LZ_H
+#define LZ_H
+
+#include <stddef.h>
+#include <sys/types.h>
+
+/* worst case compressed size of len bytes */
+size_t lz_compress_bound(size_t len);
+
+/* return the compressed size, 0 if it does not fit in dst_size */
+size_t lz_compress(const unsigned char *src, size_t len,
+		   unsigned char *dst, size_t dst_size);
+
+/* return the decompressed size, -1 if src is corrupt or dst too small */
+ssize_t lz_decompress(const unsigned char *src, size_t len,
+		      unsigned char *dst, size_t dst_size);
+
+#endif
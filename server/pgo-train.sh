@@ -0,0 +1,42 @@
+#!/bin/sh
+# Training run of the profile guided build, see the pgo target of the Makefile
+# usage: pgo-train.sh "aesdsocket command" aesdsocket-rtt [iterations]
+#
+# Runs the aesdsocket-rtt load scenarios of ../benchmarks over TCP, a UNIX
+# socket path and an abstract name, with the plain log and with sealed
+# compressed segments. Every connection is served by a child which writes
+# its profile when it exits.
+
+set -e
+
+SERVER=$1
+RTT=$2
+ITERATIONS=${3:-2000}
+SOCKPATH=/tmp/aesdsocket-pgo.sock
+
+run_server()
+{
+    ${SERVER} -t 0 -u ${SOCKPATH} -a aesdsocket-pgo "$@" > /dev/null 2>&1 &
+    SERVER_PID=$!
+    sleep 1
+}
+
+stop_server()
+{
+    kill ${SERVER_PID}
+    wait ${SERVER_PID} || true
+    rm -f ${SOCKPATH}
+}
+
+trap "kill \${SERVER_PID} 2> /dev/null || true; rm -f ${SOCKPATH}" EXIT
+
+run_server
+${RTT} -n ${ITERATIONS}
+${RTT} -n ${ITERATIONS} -u ${SOCKPATH}
+${RTT} -n ${ITERATIONS} -a aesdsocket-pgo
+stop_server
+
+run_server -s 65536
+${RTT} -n ${ITERATIONS}
+${RTT} -n ${ITERATIONS} -u ${SOCKPATH}
+stop_server
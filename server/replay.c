@@ -0,0 +1,483 @@
+#define _GNU_SOURCE
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/mman.h>
+#include <sys/file.h>  // flock
+#include <linux/errqueue.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <unistd.h>
+#include <syslog.h>
+#include <poll.h>
+#include <limits.h>    // PATH_MAX
+#include <time.h>
+#include "lz.h"
+#include "aesdtrace.h"
+#include "replay.h"
+
+// older toolchain headers lack these, the kernel needs 4.14 or later
+#ifndef SO_ZEROCOPY
+#define SO_ZEROCOPY 60
+#endif
+#ifndef MSG_ZEROCOPY
+#define MSG_ZEROCOPY 0x4000000
+#endif
+
+int scanfor(char *buf, char c, size_t limit, size_t *pos)
+{
+  int res = 0;
+  size_t index = 0;
+  char *p = buf;
+  
+  for (index = 0; index < limit; p++, index++)
+    {
+      if (*p == c)
+	{
+	  break;
+	}
+    }
+  
+  *pos = index;
+  
+  //if (*p == c)
+  if (index < limit)
+    {
+      res =  0;
+    }
+  else
+    //if (*pos == limit)
+    {
+      res = 1;
+      p--; // p points outside buffer so is undefined 
+    }
+  syslog(LOG_DEBUG, "*buf = %02x, index = %ld, return value = %d", *p, index, res);
+  return res;
+}
+
+/* read exactly len bytes at offset, return -1 on error or short file */
+int pread_full(int fd, void *buf, size_t len, off_t offset)
+{
+  ssize_t n;
+
+  while (len > 0)
+    {
+      n = pread(fd, buf, len, offset);
+      if (n == -1 && errno == EINTR)
+	continue;
+      if (n <= 0)
+	return -1;
+      buf = (char *) buf + n;
+      len -= n;
+      offset += n;
+    }
+  return 0;
+}
+
+void segment_path(char *path, size_t len, const char *datafile, unsigned int idx)
+{
+  snprintf(path, len, "%s.%06u.lz", datafile, idx);
+}
+
+/* load segment idx, *payload is malloc'ed
+   return 0 on success, 1 if there is no such segment, -1 on error */
+int read_segment(const char *datafile, unsigned int idx, struct segment_header *hdr,
+		 unsigned char **payload)
+{
+  char path[PATH_MAX];
+  int sfd;
+  int res = 0;
+
+  segment_path(path, sizeof path, datafile, idx);
+  sfd = open(path, O_RDONLY);
+  if (sfd == -1)
+    {
+      if (errno == ENOENT)
+	return 1;
+      perror("open segment error");
+      return -1;
+    }
+
+  *payload = NULL;
+  if (pread_full(sfd, hdr, sizeof *hdr, 0) == -1
+      || memcmp(hdr->magic, SEGMENT_MAGIC, sizeof hdr->magic) != 0
+      || hdr->end < hdr->start)
+    {
+      syslog(LOG_DEBUG, "bad segment header in %s", path);
+      res = -1;
+    }
+  else if ((*payload = malloc(hdr->size ? hdr->size : 1)) == NULL
+	   || pread_full(sfd, *payload, hdr->size, sizeof *hdr) == -1)
+    {
+      syslog(LOG_DEBUG, "can not read segment %s", path);
+      free(*payload);
+      *payload = NULL;
+      res = -1;
+    }
+  close(sfd);
+  return res;
+}
+
+/* decompress the segments sealed since the last replay into the cache.
+   sealed segments never change, so each one is decompressed only once
+   per connection
+   return -1 on error */
+static int cache_refresh(struct replay_cache *c)
+{
+  struct segment_header hdr;
+  struct timespec t0, t1;
+  unsigned char *payload;
+  size_t len;
+  ssize_t n;
+  char *p;
+  int res;
+
+  while ((res = read_segment(c->datafile, c->nsegs, &hdr, &payload)) == 0)
+    {
+      len = hdr.end - hdr.start;
+      if (hdr.start != c->size)
+	{
+	  syslog(LOG_DEBUG, "segment %u starts at %lu, expected %lu",
+		 c->nsegs, (unsigned long) hdr.start, (unsigned long) c->size);
+	  free(payload);
+	  return -1;
+	}
+
+      // double the cache until the segment fits
+      if (c->size + len > c->cap)
+	{
+	  if (c->cap == 0)
+	    c->cap = REPLAY_CHUNK;
+	  while (c->size + len > c->cap)
+	    c->cap *= 2;
+	  p = realloc(c->buf, c->cap);
+	  if (p == NULL)
+	    {
+	      perror("realloc replay cache error");
+	      free(payload);
+	      return -1;
+	    }
+	  c->buf = p;
+	}
+
+      clock_gettime(CLOCK_MONOTONIC, &t0);
+      if (hdr.flags & SEGMENT_STORED)
+	{
+	  n = hdr.size == len ? (ssize_t) len : -1;
+	  if (n != -1)
+	    memcpy(c->buf + c->size, payload, len);
+	}
+      else
+	{
+	  n = lz_decompress(payload, hdr.size, (unsigned char *) c->buf + c->size, len);
+	}
+      clock_gettime(CLOCK_MONOTONIC, &t1);
+      free(payload);
+      if (n != (ssize_t) len)
+	{
+	  syslog(LOG_DEBUG, "segment %u is corrupt", c->nsegs);
+	  return -1;
+	}
+
+      c->seconds += (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9;
+      c->compressed += hdr.size;
+      c->size += len;
+      c->nsegs++;
+    }
+  return res == 1 ? 0 : -1;
+}
+
+/* how long a send may block on fd, SO_SNDTIMEO in ms, -1 for no limit */
+static int send_timeout(int fd)
+{
+  struct timeval tv;
+  socklen_t len = sizeof tv;
+
+  if (getsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, &len) == -1
+      || (tv.tv_sec == 0 && tv.tv_usec == 0))
+    return -1;
+  return tv.tv_sec * 1000 + tv.tv_usec / 1000;
+}
+
+/* read zerocopy completions from the socket error queue.
+   with wait set, block until every send issued so far has completed.
+   a send completes once the peer acknowledged it, so a slow reader only
+   delays that: the wait lasts as long as the connection does, bounded by
+   SO_SNDTIMEO when set, like a blocking send
+   return -1 on error */
+static int reap_zerocopy(int fd, struct replay *rp, int wait)
+{
+  char control[128];
+  struct msghdr msg;
+  struct cmsghdr *cm;
+  struct sock_extended_err *serr;
+  struct pollfd pfd;
+  int timeout = wait ? send_timeout(fd) : 0;
+  int woken = 0;
+  int err;
+  socklen_t len;
+  int n;
+
+  while (rp->zc_done != rp->zc_sent)
+    {
+      memset(&msg, 0, sizeof msg);
+      msg.msg_control = control;
+      msg.msg_controllen = sizeof control;
+      if (recvmsg(fd, &msg, MSG_ERRQUEUE) == -1)
+	{
+	  if (errno == EINTR)
+	    continue;
+	  if (errno != EAGAIN && errno != EWOULDBLOCK)
+	    {
+	      perror("recvmsg errqueue error");
+	      return -1;
+	    }
+	  if (!wait)
+	    return 0;
+	  // woken with nothing to read: the connection failed or hung up,
+	  // which keeps poll returning at once
+	  if (woken)
+	    {
+	      len = sizeof err;
+	      if (getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &len) == -1 || err == 0)
+		err = EPIPE;
+	      syslog(LOG_DEBUG, "connection lost with zerocopy sends pending, %u of %u: %s",
+		     rp->zc_done, rp->zc_sent, strerror(err));
+	      errno = err;
+	      return -1;
+	    }
+	  // the error queue shows up as POLLERR, no event to ask for
+	  pfd.fd = fd;
+	  pfd.events = 0;
+	  n = poll(&pfd, 1, timeout);
+	  if (n == -1 && errno == EINTR)
+	    continue;
+	  if (n == -1)
+	    {
+	      perror("poll error");
+	      return -1;
+	    }
+	  if (n == 0)
+	    {
+	      syslog(LOG_DEBUG, "zerocopy completions timed out, %u of %u",
+		     rp->zc_done, rp->zc_sent);
+	      errno = EAGAIN;
+	      return -1;
+	    }
+	  woken = 1;
+	  continue;
+	}
+      woken = 0;
+      for (cm = CMSG_FIRSTHDR(&msg); cm != NULL; cm = CMSG_NXTHDR(&msg, cm))
+	{
+	  serr = (struct sock_extended_err *) CMSG_DATA(cm);
+	  if (serr->ee_origin != SO_EE_ORIGIN_ZEROCOPY || serr->ee_errno != 0)
+	    continue;
+	  // completions come as ranges of send sequence numbers
+	  rp->zc_done += serr->ee_data - serr->ee_info + 1;
+	}
+    }
+  return 0;
+}
+
+/* send the whole iovec, resuming after partial writes.
+   EAGAIN waits for the socket to become writable, so it also works on
+   non-blocking sockets
+   return -1 on error */
+static int send_iov(int fd, struct iovec *iov, int iovcnt, int flags, struct replay *rp)
+{
+  struct msghdr msg;
+  struct pollfd pfd;
+  ssize_t n;
+
+  while (iovcnt > 0)
+    {
+      memset(&msg, 0, sizeof msg);
+      msg.msg_iov = iov;
+      msg.msg_iovlen = iovcnt;
+      n = sendmsg(fd, &msg, flags | MSG_NOSIGNAL);
+      if (n == -1)
+	{
+	  if (errno == EINTR)
+	    continue;
+	  if (errno == EAGAIN || errno == EWOULDBLOCK)
+	    {
+	      pfd.fd = fd;
+	      pfd.events = POLLOUT;
+	      poll(&pfd, 1, -1);
+	      continue;
+	    }
+	  if (errno == ENOBUFS && (flags & MSG_ZEROCOPY))
+	    {
+	      // too many pages pinned, let the pending sends finish.  with
+	      // none of ours pending the pages are pinned by the other
+	      // connections, so this send copies instead
+	      if (rp->zc_done == rp->zc_sent)
+		flags &= ~MSG_ZEROCOPY;
+	      else if (reap_zerocopy(fd, rp, 1) == -1)
+		return -1;
+	      continue;
+	    }
+	  perror("send error");
+	  syslog(LOG_DEBUG, "error sending data back");
+	  return -1;
+	}
+      if (flags & MSG_ZEROCOPY)
+	rp->zc_sent++;
+
+      // skip what went out, the rest goes in the next round
+      while (iovcnt > 0 && (size_t) n >= iov->iov_len)
+	{
+	  n -= iov->iov_len;
+	  iov++;
+	  iovcnt--;
+	}
+      if (iovcnt > 0)
+	{
+	  iov->iov_base = (char *) iov->iov_base + n;
+	  iov->iov_len -= n;
+	}
+    }
+  return 0;
+}
+
+/* large replay: send straight from a mapping of the log with MSG_ZEROCOPY.
+   the log is append only so the mapped pages never change under a send
+   return -1 on error, 1 if zerocopy is not usable for this socket */
+static int send_zerocopy(int fd, int logfd, size_t start, size_t total, struct replay *rp)
+{
+  struct iovec iov;
+  char *map;
+  size_t mapstart = start & ~((size_t) sysconf(_SC_PAGESIZE) - 1);
+  size_t offset;
+  size_t len;
+  int yes = 1;
+  int res = 0;
+
+  if (rp->zerocopy == 0)
+    {
+      // not available on AF_UNIX or old kernels
+      rp->zerocopy = setsockopt(fd, SOL_SOCKET, SO_ZEROCOPY, &yes, sizeof yes) == 0 ? 1 : -1;
+      syslog(LOG_DEBUG, "SO_ZEROCOPY %s", rp->zerocopy == 1 ? "enabled" : "not supported");
+    }
+  if (rp->zerocopy != 1)
+    return 1;
+
+  map = mmap(NULL, total - mapstart, PROT_READ, MAP_SHARED, logfd, mapstart);
+  if (map == MAP_FAILED)
+    {
+      perror("mmap error");
+      return 1;
+    }
+
+  syslog(LOG_DEBUG,"sending %ld bytes back to client with zerocopy", total - start);
+  // one iovec per send: the mapping is contiguous, so more iovecs would
+  // only make a longer chunk.  the chunk bounds the pages pinned at once,
+  // which count against RLIMIT_MEMLOCK, and lets the completions be read
+  // between sends; MSG_MORE already merges the chunks into full segments
+  for (offset = start; offset < total && res == 0; offset += len)
+    {
+      len = total - offset < ZEROCOPY_CHUNK ? total - offset : ZEROCOPY_CHUNK;
+      iov.iov_base = map + (offset - mapstart);
+      iov.iov_len = len;
+      res = send_iov(fd, &iov, 1, MSG_ZEROCOPY | (offset + len < total ? MSG_MORE : 0), rp);
+      reap_zerocopy(fd, rp, 0);
+    }
+
+  // the pages may not go away before the kernel is done with them
+  if (reap_zerocopy(fd, rp, 1) == -1)
+    res = -1;
+  munmap(map, total - mapstart);
+  return res;
+}
+
+/* send log bytes [start, total) of the tail file.
+   every send but the last carries MSG_MORE so the data goes out in full
+   segments */
+static int send_tail(int fd, int logfd, size_t start, size_t total, char *buf, size_t buf_size, struct replay *rp)
+{
+  struct iovec iov;
+  ssize_t bytesread;
+  off_t offset = start;
+  int res;
+
+  if (rp->zerocopy_threshold > 0 && total - start >= rp->zerocopy_threshold)
+    {
+      res = send_zerocopy(fd, logfd, start, total, rp);
+      if (res != 1)
+	return res;
+      // fall back to copying
+    }
+
+  // pread keeps the file offset shared with the other connections untouched
+  while ((size_t) offset < total)
+    {
+      bytesread = pread(logfd, buf, total - offset < buf_size ? total - offset : buf_size, offset);
+      if (bytesread == -1)
+	{
+	  if (errno == EINTR)
+	    continue;
+	  perror("read error");
+	  syslog(LOG_DEBUG, "error in reading data log");
+	  return -1;
+	}
+      if (bytesread == 0)
+	return 0;
+      offset += bytesread;
+
+      syslog(LOG_DEBUG,"sending %ld bytes back to client", bytesread);
+      iov.iov_base = buf;
+      iov.iov_len = bytesread;
+      if (send_iov(fd, &iov, 1, (size_t) offset < total ? MSG_MORE : 0, rp) == -1)
+	{
+	  return -1;
+	}
+    }
+  return 0;
+}
+
+/* send all message in logfd, though fd.
+   only what the log holds when the replay starts is sent: the sealed
+   segments from the replay cache, then the uncompressed tail */
+int send_all(int fd, int logfd, char *buf, size_t buf_size, struct replay *rp)
+{
+  struct stat st;
+  struct iovec iov;
+  int res = 0;
+
+  if (rp->lockfd != -1)
+    flock(rp->lockfd, LOCK_SH);
+  if (rp->segments && cache_refresh(&rp->cache) == -1)
+    res = -1;
+
+  if (res == 0 && fstat(logfd, &st) == -1)
+    {
+      perror("fstat error");
+      res = -1;
+    }
+
+  if (res == 0)
+    {
+      AESD_TRACE2(replay_start, rp->conn_id, st.st_size);
+    }
+
+  if (res == 0 && rp->cache.size > 0)
+    {
+      syslog(LOG_DEBUG,"sending %ld bytes back to client from replay cache", rp->cache.size);
+      iov.iov_base = rp->cache.buf;
+      iov.iov_len = rp->cache.size;
+      res = send_iov(fd, &iov, 1, (size_t) st.st_size > rp->cache.size ? MSG_MORE : 0, rp);
+    }
+  if (res == 0 && (size_t) st.st_size > rp->cache.size)
+    {
+      res = send_tail(fd, logfd, rp->cache.size, st.st_size, buf, buf_size, rp);
+    }
+
+  if (rp->lockfd != -1)
+    flock(rp->lockfd, LOCK_UN);
+  AESD_TRACE2(replay_end, rp->conn_id, res);
+  return res;
+}
@@ -0,0 +1,73 @@
+/*
+  replay: the data path of an aesdsocket connection, finding the end of
+  the packets it receives and sending the whole log back after each one
+
+  The log is a tail file opened with O_APPEND, the data file, whose
+  beginning may be sealed into compressed segments "datafile.NNNNNN.lz"
+  by the listening process, see seal_segment in aesdsocket.c. A segment
+  is a struct segment_header followed by its payload.
+ */
+#ifndef REPLAY_H
+#define REPLAY_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#define REPLAY_CHUNK (64 * 1024)  // bytes per copied send of the replay
+#define ZEROCOPY_CHUNK (1024 * 1024)  // bytes per MSG_ZEROCOPY send
+#define SEGMENT_MAGIC "ALZ1"
+#define SEGMENT_STORED 0x1  // payload kept as is, it did not compress
+
+/* header of a sealed segment file, which holds log bytes [start, end) */
+struct segment_header {
+  char magic[4];
+  uint32_t flags;
+  uint64_t start;
+  uint64_t end;
+  uint64_t size;      // payload bytes following the header
+};
+
+/* decompressed segments of one connection, the tail starts at size */
+struct replay_cache {
+  const char *datafile;  // log the segments belong to
+  char *buf;
+  size_t size;
+  size_t cap;
+  unsigned int nsegs;
+  uint64_t compressed;   // stats: payload bytes read
+  double seconds;        // stats: time spent decompressing
+};
+
+/* replay state of one connection */
+struct replay {
+  size_t zerocopy_threshold;
+  int zerocopy;       // 1 enabled, -1 not supported by the socket, 0 not tried
+  uint32_t zc_sent;   // MSG_ZEROCOPY sends issued
+  uint32_t zc_done;   // their completions read from the error queue
+  int segments;       // sealed segments come from the cache
+  int lockfd;         // shared lock held while replaying, -1 for none
+  struct replay_cache cache;
+  unsigned long conn_id; // for the tracepoints
+};
+
+/* *pos is the index of the first c in buf[0, limit), or limit.
+   return 0 if c was found, 1 if not */
+int scanfor(char *buf, char c, size_t limit, size_t *pos);
+
+/* read exactly len bytes at offset, return -1 on error or short file */
+int pread_full(int fd, void *buf, size_t len, off_t offset);
+
+/* the name of segment idx of datafile */
+void segment_path(char *path, size_t len, const char *datafile, unsigned int idx);
+
+/* load segment idx, *payload is malloc'ed
+   return 0 on success, 1 if there is no such segment, -1 on error */
+int read_segment(const char *datafile, unsigned int idx, struct segment_header *hdr,
+		 unsigned char **payload);
+
+/* send the log through fd, the sealed segments and then logfd, the tail.
+   buf of buf_size bytes holds the copied sends. return -1 on error */
+int send_all(int fd, int logfd, char *buf, size_t buf_size, struct replay *rp);
+
+#endif